@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * --bench of the generators: throughput report and golden bsmap checksums.
+ *
+ * The checksum of a full (not dihedral-reduced) bsmap is the sum over its
+ * non-zero words w at index i of mix(w ^ mix(i)), mix being the splitmix64
+ * finalizer.  It does not depend on the order the words are visited in, so
+ * it can be computed in parallel, and the count of patterns is taken in the
+ * same pass.  Both bit layouts of the generators (cell (i, j) at bit
+ * ORDER*i+j or at its mirror image) give the same map, since the 180 degree
+ * rotation maps the set of patterns onto itself.
+ *
+ * The reference values were computed by a plain recursive enumeration over
+ * the whole coefficient box, independent of the generators, and agree with
+ * the innovative counts bsmap_gather reports.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+struct bench_golden {
+    int order, coeff_min, coeff_max;
+    uint64_t count, checksum;
+};
+
+static const struct bench_golden bench_goldens[] = {
+    {5, -1, 1, 161322, UINT64_C(0x5b9ebf3abab7a59a)},
+    {5, -2, 2, 1054230, UINT64_C(0xbf941005d608f804)},
+    {5, 0, 1, 2618, UINT64_C(0x236599aa0bb00a10)},
+    {6, -1, 1, 1788869, UINT64_C(0xeafadb66c84093c0)},
+    {6, 0, 1, 12464, UINT64_C(0x050e5bd0e4bbd685)},
+};
+#define BENCH_NGOLDENS (sizeof(bench_goldens) / sizeof(bench_goldens[0]))
+
+/*
+ * Tuples of the full coefficient box covered by nouter outer iterations with
+ * ninner inner lines each, where c0 runs over nc0 of the radix values.  The
+ * AVX kernels only enumerate c0 >= 0 (t and -t give the same pattern) and
+ * are credited with the whole box, so that tuples/s compares across kernels.
+ */
+static inline uint64_t bench_tuples(const size_t nouter, const int radix,
+        const int ninner, const int nc0)
+{
+    uint64_t tuples = nouter;
+    int i;
+
+    for (i = 0; i < ninner; i ++)
+        tuples *= radix;
+    return tuples * radix / nc0;
+}
+
+/*
+ * tuples is the number of coefficient tuples covered, including those the
+ * symmetry reductions skip, and inserts the number of patterns actually
+ * looked up in the map.
+ */
+static inline void bench_report(const uint64_t tuples, const uint64_t inserts,
+        const double seconds, const int nthreads)
+{
+    printf("bench: %" PRIu64 " tuples, %" PRIu64 " inserts in %.3f s\n",
+            tuples, inserts, seconds);
+    printf("bench: %.3e tuples/s, %.3e inserts/s\n",
+            tuples / seconds, inserts / seconds);
+    printf("bench: %.3e tuples/s, %.3e inserts/s per thread (%d thread(s))\n",
+            tuples / seconds / nthreads, inserts / seconds / nthreads, nthreads);
+}
+
+/*
+ * dTLB load misses of the enumeration, counted per thread since inherited
+ * counters only see threads that have exited.  The counters are opened on
+ * every thread of the OpenMP team and read from the master afterwards.
+ */
+static int *bench_tlb_fds = NULL, bench_tlb_nfds = 0, bench_tlb_errno = 0;
+
+static inline void bench_tlb_start(void)
+{
+    struct perf_event_attr attr;
+    int i;
+
+    (void) memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+#if defined(_OPENMP)
+    bench_tlb_nfds = omp_get_max_threads();
+#else
+    bench_tlb_nfds = 1;
+#endif
+    bench_tlb_fds = malloc(sizeof(*bench_tlb_fds) * bench_tlb_nfds);
+    if (bench_tlb_fds == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < bench_tlb_nfds; i ++)
+        bench_tlb_fds[i] = -1;
+    bench_tlb_errno = 0;
+#pragma omp parallel
+    {
+#if defined(_OPENMP)
+        const int tid = omp_get_thread_num();
+#else
+        const int tid = 0;
+#endif
+        bench_tlb_fds[tid] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (bench_tlb_fds[tid] < 0)
+            bench_tlb_errno = errno;
+    }
+}
+
+/* Print the dTLB load misses counted since bench_tlb_start(). */
+static inline void bench_tlb_report(const uint64_t inserts)
+{
+    uint64_t misses = 0, n;
+    int i, ok = !bench_tlb_errno;
+
+    for (i = 0; i < bench_tlb_nfds; i ++) {
+        if (bench_tlb_fds[i] < 0)
+            continue;
+        if (read(bench_tlb_fds[i], &n, sizeof(n)) == sizeof(n))
+            misses += n;
+        else
+            ok = 0;
+        (void) close(bench_tlb_fds[i]);
+    }
+    free(bench_tlb_fds);
+    bench_tlb_fds = NULL;
+    if (ok)
+        printf("bench: %" PRIu64 " dTLB load misses, %.4f per insert\n",
+                misses, (double) misses / inserts);
+    else
+        printf("bench: dTLB load misses not available: %s\n",
+                strerror(bench_tlb_errno ? bench_tlb_errno : EIO));
+}
+
+static inline uint64_t bench_mix(uint64_t x)
+{
+    x += UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t bench_checksum(const uint64_t *map, const size_t nwords,
+        uint64_t *countp)
+{
+    uint64_t checksum = 0, count = 0;
+    size_t i;
+
+#pragma omp parallel for reduction(+:checksum, count)
+    for (i = 0; i < nwords; i ++) {
+        if (map[i] == 0)
+            continue;
+        count += __builtin_popcountll(map[i]);
+        checksum += bench_mix(map[i] ^ bench_mix(i));
+    }
+    *countp = count;
+    return checksum;
+}
+
+/*
+ * Report count and checksum and compare them with the reference for the
+ * range, if there is one.  Return non-zero on a mismatch.
+ */
+static inline int bench_check(const int order, const int coeff_min,
+        const int coeff_max, const uint64_t count, const uint64_t checksum)
+{
+    size_t i;
+
+    printf("bench: %" PRIu64 " patterns, checksum %016" PRIx64 "\n",
+            count, checksum);
+    for (i = 0; i < BENCH_NGOLDENS; i ++) {
+        const struct bench_golden *g = &bench_goldens[i];
+        if (g->order != order || g->coeff_min != coeff_min
+                || g->coeff_max != coeff_max)
+            continue;
+        if (g->count == count && g->checksum == checksum) {
+            printf("golden: OK\n");
+            return 0;
+        }
+        printf("golden: MISMATCH, expected %" PRIu64 " patterns, checksum %016"
+                PRIx64 "\n", g->count, g->checksum);
+        return 1;
+    }
+    printf("golden: No reference for ORDER=%d COEFF_{MIN,MAX} = {%d, %d}\n",
+            order, coeff_min, coeff_max);
+    return 0;
+}
+
+#endif /* BENCH_H */
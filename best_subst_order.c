@@ -16,6 +16,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
+#include <getopt.h>
+#include <immintrin.h>
+#include <time.h>
+#include <inttypes.h>
 
 
 #define __stringify_1(x...) #x
@@ -36,12 +40,58 @@ typedef uint32_t binsquare_t;
 #define DEPTH_MAX 14
 #define SCORE_BASE_SHIFT 5
 #define BSLIST_LEN 1188905
+#define PROP_ENGINE_DEFAULT PROP_ENGINE_TABLE
 #elif ORDER == 6
 typedef uint64_t binsquare_t;
 #define popcount_bs __builtin_popcountll
 #define DEPTH_MAX 23
 #define SCORE_BASE_SHIFT 5
 #define BSLIST_LEN 0xdeadbeaf
+#define PROP_ENGINE_DEFAULT PROP_ENGINE_WATCH
+#endif
+
+/* Unit propagation engine; see below. */
+#define PROP_ENGINE_TABLE 0
+#define PROP_ENGINE_WATCH 1
+#define PROP_ENGINE_SCAN  2
+#ifndef PROP_ENGINE
+#define PROP_ENGINE PROP_ENGINE_DEFAULT
+#endif
+#if PROP_ENGINE == PROP_ENGINE_TABLE && ORDER != 5
+#error "PROP_ENGINE_TABLE needs 2^(ORDER*ORDER-1) bits per cell; use it for ORDER=5 only"
+#endif
+/* Whether several threads can propagate at once. */
+#define PROP_THREAD_SAFE (PROP_ENGINE != PROP_ENGINE_WATCH)
+
+/* Children below this depth are searched in parallel as OpenMP tasks. */
+#ifndef TASK_DEPTH_MAX
+#define TASK_DEPTH_MAX 8
+#endif
+
+/*
+ * Transposition table budget in MiB (0 disables it) and its replacement
+ * policy: TT_POLICY_ALWAYS overwrites the slot, TT_POLICY_DEPTH only lets an
+ * entry at the same or a smaller depth (a larger subtree) evict another.
+ */
+#ifndef TT_MB
+#define TT_MB 256
+#endif
+#define TT_POLICY_ALWAYS 0
+#define TT_POLICY_DEPTH 1
+#ifndef TT_POLICY
+#define TT_POLICY TT_POLICY_DEPTH
+#endif
+
+/*
+ * Branch-and-bound.  BNB_PREFIX prunes a subtree as soon as its own
+ * score_base cannot lift it above the incumbent; BNB_CELLS also bounds what
+ * the rest of the subtree can add by the number of empty cells.
+ */
+#define BNB_NONE 0
+#define BNB_PREFIX 1
+#define BNB_CELLS 2
+#ifndef BNB
+#define BNB BNB_CELLS
 #endif
 
 
@@ -102,13 +152,647 @@ static void* bslist_load(void)
 
 static binsquare_t *bslist;
 
-#define ALONE_1(x) (((x) & ((x) - 1)) ? 0 : (x))
 #define RIGHTMOST_0(x) (~(x) & ((x) + 1))
 #define NEXT_BF(bf, filled) RIGHTMOST_0((filled) | (((bf) << 1) - 1))
+#define CELL(x) ((int) __builtin_ctzll(x))
+#define ALONE_1(x) (((x) & ((x) - 1)) ? 0 : (x))
+
+/*
+ * bslist scan kernels.  scan_all returns the OR of ALONE_1(~filled & e) over
+ * the entries e of list, i.e. all the cells forced by a single pass, and
+ * scan_first the index of the first entry that forces a cell (len if there is
+ * none), as the original retry loop found it.  They come in scalar, AVX2 and
+ * AVX-512 flavours, built with target attributes so that one binary serves
+ * every CPU, and are listed widest first.
+ */
+#if ORDER == 5
+#define SCAN_AVX2_LANES 8
+#define SCAN_AVX512_LANES 16
+#define mm256_set1_bs _mm256_set1_epi32
+#define mm256_sub_bs _mm256_sub_epi32
+#define mm256_cmpeq_bs _mm256_cmpeq_epi32
+#define mm256_movemask_bs(x) _mm256_movemask_ps(_mm256_castsi256_ps(x))
+#define mm512_set1_bs _mm512_set1_epi32
+#define mm512_sub_bs _mm512_sub_epi32
+#define mm512_cmpeq_bs_mask _mm512_cmpeq_epi32_mask
+#define mm512_mask_cmpneq_bs_mask _mm512_mask_cmpneq_epi32_mask
+#define mm512_mask_or_bs _mm512_mask_or_epi32
+#define mm512_reduce_or_bs _mm512_reduce_or_epi32
+#else
+#define SCAN_AVX2_LANES 4
+#define SCAN_AVX512_LANES 8
+#define mm256_set1_bs _mm256_set1_epi64x
+#define mm256_sub_bs _mm256_sub_epi64
+#define mm256_cmpeq_bs _mm256_cmpeq_epi64
+#define mm256_movemask_bs(x) _mm256_movemask_pd(_mm256_castsi256_pd(x))
+#define mm512_set1_bs _mm512_set1_epi64
+#define mm512_sub_bs _mm512_sub_epi64
+#define mm512_cmpeq_bs_mask _mm512_cmpeq_epi64_mask
+#define mm512_mask_cmpneq_bs_mask _mm512_mask_cmpneq_epi64_mask
+#define mm512_mask_or_bs _mm512_mask_or_epi64
+#define mm512_reduce_or_bs _mm512_reduce_or_epi64
+#endif
+
+static binsquare_t scan_all_scalar(const binsquare_t *list, const size_t len,
+        const binsquare_t filled)
+{
+    binsquare_t forced = 0;
+    size_t i;
+    for (i = 0; i < len; i ++)
+        forced |= ALONE_1(~filled & list[i]);
+    return forced;
+}
+
+static size_t scan_first_scalar(const binsquare_t *list, const size_t len,
+        const binsquare_t filled)
+{
+    size_t i;
+    for (i = 0; i < len; i ++)
+        if (ALONE_1(~filled & list[i]))
+            return i;
+    return len;
+}
+
+__attribute__((target("avx2")))
+static binsquare_t scan_all_avx2(const binsquare_t *list, const size_t len,
+        const binsquare_t filled)
+{
+    const __m256i nf = mm256_set1_bs(~filled), one = mm256_set1_bs(1),
+          zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    binsquare_t lanes[SCAN_AVX2_LANES], forced;
+    size_t i;
+    int j;
+
+    for (i = 0; i + SCAN_AVX2_LANES <= len; i += SCAN_AVX2_LANES) {
+        const __m256i x = _mm256_and_si256(nf,
+                _mm256_loadu_si256((const __m256i*) (list + i)));
+        const __m256i t = _mm256_and_si256(x, mm256_sub_bs(x, one));
+        /* x == 0 passes the test too but contributes nothing. */
+        acc = _mm256_or_si256(acc, _mm256_and_si256(x, mm256_cmpeq_bs(t, zero)));
+    }
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+    forced = scan_all_scalar(list + i, len - i, filled);
+    for (j = 0; j < SCAN_AVX2_LANES; j ++)
+        forced |= lanes[j];
+    return forced;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_first_avx2(const binsquare_t *list, const size_t len,
+        const binsquare_t filled)
+{
+    const __m256i nf = mm256_set1_bs(~filled), one = mm256_set1_bs(1),
+          zero = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + SCAN_AVX2_LANES <= len; i += SCAN_AVX2_LANES) {
+        const __m256i x = _mm256_and_si256(nf,
+                _mm256_loadu_si256((const __m256i*) (list + i)));
+        const __m256i t = _mm256_and_si256(x, mm256_sub_bs(x, one));
+        const int m = mm256_movemask_bs(mm256_cmpeq_bs(t, zero))
+            & ~mm256_movemask_bs(mm256_cmpeq_bs(x, zero));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + scan_first_scalar(list + i, len - i, filled);
+}
+
+__attribute__((target("avx512f")))
+static binsquare_t scan_all_avx512(const binsquare_t *list, const size_t len,
+        const binsquare_t filled)
+{
+    const __m512i nf = mm512_set1_bs(~filled), one = mm512_set1_bs(1),
+          zero = _mm512_setzero_si512();
+    __m512i acc = zero;
+    size_t i;
+
+    for (i = 0; i + SCAN_AVX512_LANES <= len; i += SCAN_AVX512_LANES) {
+        const __m512i x = _mm512_and_si512(nf, _mm512_loadu_si512(list + i));
+        const __m512i t = _mm512_and_si512(x, mm512_sub_bs(x, one));
+        acc = mm512_mask_or_bs(acc, mm512_cmpeq_bs_mask(t, zero), acc, x);
+    }
+    return mm512_reduce_or_bs(acc) | scan_all_scalar(list + i, len - i, filled);
+}
+
+__attribute__((target("avx512f")))
+static size_t scan_first_avx512(const binsquare_t *list, const size_t len,
+        const binsquare_t filled)
+{
+    const __m512i nf = mm512_set1_bs(~filled), one = mm512_set1_bs(1),
+          zero = _mm512_setzero_si512();
+    size_t i;
+
+    for (i = 0; i + SCAN_AVX512_LANES <= len; i += SCAN_AVX512_LANES) {
+        const __m512i x = _mm512_and_si512(nf, _mm512_loadu_si512(list + i));
+        const __m512i t = _mm512_and_si512(x, mm512_sub_bs(x, one));
+        const unsigned m = mm512_mask_cmpneq_bs_mask(
+                mm512_cmpeq_bs_mask(t, zero), x, zero);
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + scan_first_scalar(list + i, len - i, filled);
+}
+
+struct scan_kernel {
+    const char *name;
+    const char *isa; /* For __builtin_cpu_supports, or NULL. */
+    binsquare_t (*all)(const binsquare_t*, size_t, binsquare_t);
+    size_t (*first)(const binsquare_t*, size_t, binsquare_t);
+};
+
+static const struct scan_kernel scan_kernels[] = {
+    {"avx512", "avx512f", scan_all_avx512, scan_first_avx512},
+    {"avx2", "avx2", scan_all_avx2, scan_first_avx2},
+    {"scalar", NULL, scan_all_scalar, scan_first_scalar},
+};
+#define SCAN_NKERNELS (sizeof(scan_kernels) / sizeof(scan_kernels[0]))
+
+static int scan_kernel_supported(const struct scan_kernel *k)
+{
+    __builtin_cpu_init();
+    /* __builtin_cpu_supports only takes string literals. */
+    if (k->isa == NULL)
+        return 1;
+    if (!strcmp(k->isa, "avx512f"))
+        return __builtin_cpu_supports("avx512f");
+    if (!strcmp(k->isa, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    return 0;
+}
+
+/*
+ * Unit propagation.  A bslist entry with exactly one unfilled cell forces
+ * that cell, and filling a cell is followed by filling everything it forces,
+ * up to the fixpoint.  The rescan of the whole bslist after every forced cell
+ * is replaced by one of three engines (PROP_ENGINE) with the same fixpoint,
+ * so obv does not change:
+ *
+ * TABLE (default for ORDER=5): a forced-cell table.  Cell c is forced in
+ * filled iff some entry e containing c has e & ~c within filled, so
+ * force_table[c] holds, for every subset S of the other 24 cells, whether
+ * such an entry with e & ~c within S exists (the up-closure of the entries
+ * containing c).  A propagation step is then one bit lookup per unfilled
+ * cell; the tables take 25 * 2 MiB.  The tables are read-only, so the search
+ * can propagate from many threads.
+ *
+ * WATCH (default for ORDER=6, where the tables would take 36 * 4 GiB): every
+ * entry watches two of its unfilled cells as SAT solvers do with watched
+ * literals, and every cell has the list of entries watching it.  Filling a
+ * cell only visits its own watchers: each one either moves the watch to
+ * another unfilled cell or, if there is none, forces its other watched cell,
+ * which is queued.  Watches are only ever moved to cells that are unfilled at
+ * that moment, so they stay valid when cells are unfilled again and
+ * backtracking costs nothing.  The watches are shared state mirroring the
+ * filled of the caller (prop_filled), so this engine runs the search on one
+ * thread.
+ *
+ * SCAN: full passes of the SIMD scan kernel above, each forcing every cell it
+ * finds, until nothing changes.  Stateless like TABLE.
+ */
+#define CELL_MASK(c) (((binsquare_t) 1) << (c))
+#define CELLS_ALL ((((binsquare_t) 1) << (ORDER*ORDER - 1) << 1) - 1)
+
+#if PROP_ENGINE == PROP_ENGINE_TABLE
+
+static uint64_t *force_table[ORDER*ORDER];
+
+/* Index of the subset filled & ~c of the cells other than c. */
+static inline size_t force_index(const binsquare_t filled, const int c)
+{
+    const binsquare_t f = filled & CELLS_ALL;
+    return (f & (CELL_MASK(c) - 1)) | ((f >> (c + 1)) << c);
+}
+
+static void prop_init(const binsquare_t filled)
+{
+    static const uint64_t lower[6] = {
+        0x5555555555555555, 0x3333333333333333, 0x0f0f0f0f0f0f0f0f,
+        0x00ff00ff00ff00ff, 0x0000ffff0000ffff, 0x00000000ffffffff,
+    };
+    const size_t nwords = (((size_t) 1) << (ORDER*ORDER - 1)) / 64;
+    size_t i, w;
+    int c, j;
+
+    for (c = 0; c < ORDER*ORDER; c ++) {
+        uint64_t *t = calloc(nwords, sizeof(*t));
+        if (t == NULL) {
+            fprintf(stderr, "calloc: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < BSLIST_LEN; i ++) {
+            if (bslist[i] & CELL_MASK(c)) {
+                const size_t idx = force_index(bslist[i], c);
+                t[idx >> 6] |= ((uint64_t) 1) << (idx & 63);
+            }
+        }
+
+        /* Up-closure: S implies S | j for every other cell j. */
+        for (j = 0; j < 6; j ++)
+            for (w = 0; w < nwords; w ++)
+                t[w] |= (t[w] & lower[j]) << (1 << j);
+        for (j = 0; ((size_t) 1 << j) < nwords; j ++)
+            for (w = 0; w < nwords; w ++)
+                if (!(w & ((size_t) 1 << j)))
+                    t[w | ((size_t) 1 << j)] |= t[w];
+
+        force_table[c] = t;
+    }
+
+    (void) filled;
+}
+
+/*
+ * Fill bf and everything it forces into *filledp.  Return the forced cells.
+ * The state is only *filledp, so any number of threads can propagate at once.
+ */
+static binsquare_t prop_propagate(binsquare_t *filledp, const binsquare_t bf)
+{
+    binsquare_t filled = *filledp | bf, obv = 0, bs;
+    int changed;
+
+    do {
+        changed = 0;
+        for (bs = ~filled & CELLS_ALL; bs; bs &= bs - 1) {
+            const int c = CELL(bs);
+            const size_t idx = force_index(filled, c);
+            if (force_table[c][idx >> 6] & (((uint64_t) 1) << (idx & 63))) {
+                filled |= CELL_MASK(c);
+                obv |= CELL_MASK(c);
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    *filledp = filled;
+    return obv;
+}
+
+static void prop_assign(const binsquare_t cells)
+{
+    (void) cells;
+}
+
+static void prop_undo(const binsquare_t cells)
+{
+    (void) cells;
+}
+
+#elif PROP_ENGINE == PROP_ENGINE_WATCH
+
+#define WATCH_NONE 0xff
+
+static binsquare_t prop_filled;
+static uint32_t *watchers[ORDER*ORDER];
+static size_t watchers_len[ORDER*ORDER];
+static uint8_t (*watch)[2];
+static binsquare_t prop_seed; /* Cells forced before anything is filled. */
+static int prop_queue[ORDER*ORDER];
+static unsigned prop_queue_len;
+static binsquare_t prop_queued;
+
+static void prop_enqueue(const int cell)
+{
+    if (!(prop_queued & CELL_MASK(cell))) {
+        prop_queued |= CELL_MASK(cell);
+        prop_queue[prop_queue_len ++] = cell;
+    }
+}
+
+static void prop_init(const binsquare_t filled)
+{
+    size_t i, cnt[ORDER*ORDER] = {0};
+    int c;
+
+    watch = malloc(BSLIST_LEN * sizeof(*watch));
+    if (watch == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* A cell can be watched by at most the entries containing it. */
+    for (i = 0; i < BSLIST_LEN; i ++)
+        for (c = 0; c < ORDER*ORDER; c ++)
+            cnt[c] += !!(bslist[i] & CELL_MASK(c));
+    for (c = 0; c < ORDER*ORDER; c ++) {
+        watchers[c] = malloc(cnt[c] * sizeof(*watchers[c]));
+        if (watchers[c] == NULL && cnt[c] != 0) {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    prop_filled = filled;
+    prop_seed = 0;
+    for (i = 0; i < BSLIST_LEN; i ++) {
+        binsquare_t unfilled = ~filled & bslist[i];
+        int j;
+        for (j = 0; j < 2; j ++) {
+            if (unfilled == 0) {
+                watch[i][j] = WATCH_NONE;
+                continue;
+            }
+            c = CELL(unfilled);
+            unfilled &= unfilled - 1;
+            watch[i][j] = c;
+            watchers[c][watchers_len[c] ++] = i;
+        }
+        if (watch[i][0] != WATCH_NONE && watch[i][1] == WATCH_NONE)
+            prop_seed |= CELL_MASK(watch[i][0]);
+    }
+}
+
+static inline void prop_fill(const int cell)
+{
+    uint32_t *w = watchers[cell];
+    size_t i = 0, len = watchers_len[cell];
+
+    prop_filled |= CELL_MASK(cell);
+    while (i < len) {
+        const uint32_t e = w[i];
+        const int k = (watch[e][0] != cell);
+        const int other = watch[e][!k];
+        const binsquare_t avail = ~prop_filled & bslist[e]
+            & ~(other == WATCH_NONE ? 0 : CELL_MASK(other));
+
+        if (avail) {
+            const int c = CELL(avail);
+            watch[e][k] = c;
+            watchers[c][watchers_len[c] ++] = e;
+            w[i] = w[-- len];
+            continue;
+        }
+        if (other != WATCH_NONE && !(prop_filled & CELL_MASK(other)))
+            prop_enqueue(other);
+        i ++;
+    }
+    watchers_len[cell] = len;
+}
+
+/*
+ * Fill bf and everything it forces into *filledp.  Return the forced cells.
+ * The watches are shared, so only one thread may propagate at a time.
+ */
+static binsquare_t prop_propagate(binsquare_t *filledp, const binsquare_t bf)
+{
+    binsquare_t obv = 0, bs;
+
+    for (bs = prop_seed & ~prop_filled; bs; bs &= bs - 1)
+        prop_enqueue(CELL(bs));
+
+    prop_fill(CELL(bf));
+    while (prop_queue_len != 0) {
+        const int c = prop_queue[-- prop_queue_len];
+        if (prop_filled & CELL_MASK(c))
+            continue;
+        obv |= CELL_MASK(c);
+        prop_fill(c);
+    }
+    prop_queued = 0;
 
-static score_t best_order_recurse(binsquare_t filled, const unsigned depth)
+    *filledp |= bf | obv;
+    return obv;
+}
+
+/* Fill cells whose closure is already known, without propagating. */
+static void prop_assign(binsquare_t cells)
+{
+    for (; cells; cells &= cells - 1)
+        prop_fill(CELL(cells));
+    prop_queue_len = 0;
+    prop_queued = 0;
+}
+
+/* Watches stay valid, so unfilling only has to clear the cells. */
+static void prop_undo(const binsquare_t cells)
+{
+    prop_filled &= ~cells;
+}
+
+#elif PROP_ENGINE == PROP_ENGINE_SCAN
+
+static const struct scan_kernel *scan;
+
+/* Use the widest scan kernel the CPU supports. */
+static void prop_init(const binsquare_t filled)
+{
+    (void) filled;
+    for (scan = scan_kernels; !scan_kernel_supported(scan); scan ++)
+        ;
+    printf("Scan kernel: %s\n", scan->name);
+}
+
+/*
+ * Fill bf and everything it forces into *filledp.  Return the forced cells.
+ * Every pass forces all the cells it finds at once.
+ */
+static binsquare_t prop_propagate(binsquare_t *filledp, const binsquare_t bf)
+{
+    binsquare_t filled = *filledp | bf, obv = 0, forced;
+
+    while ((forced = scan->all(bslist, BSLIST_LEN, filled) & ~filled) != 0) {
+        filled |= forced;
+        obv |= forced;
+    }
+
+    *filledp = filled;
+    return obv;
+}
+
+static void prop_assign(const binsquare_t cells)
+{
+    (void) cells;
+}
+
+static void prop_undo(const binsquare_t cells)
+{
+    (void) cells;
+}
+
+#endif /* PROP_ENGINE */
+
+/*
+ * Transposition table.  The result of best_order_recurse only depends on
+ * (filled, depth), and different choices often reach the same state, so it is
+ * stored in a fixed-size table shared by all threads.  It is lock-free in the
+ * manner of lockless hashing: an entry is three words written with relaxed
+ * atomics, the first being the key XORed with the two words of the score, so
+ * that a torn entry (written by two threads at once) fails the key check and
+ * is a miss.  Keys always have their top bit set, so the all-zero empty slot
+ * never matches.  A score cut off by branch-and-bound is only an upper bound
+ * and is stored with TT_UPPER; it answers probes whose bound it does not
+ * exceed.
+ */
+struct tt_entry {
+    uint64_t check, lo, hi;
+};
+
+#define TT_UPPER (((score_t) 1) << 127)
+
+static struct tt_entry *tt;
+static uint64_t tt_mask;
+static uint64_t tt_hits, tt_misses, tt_stores;
+#pragma omp threadprivate(tt_hits, tt_misses, tt_stores)
+
+static inline uint64_t tt_key(const binsquare_t filled, const unsigned depth)
+{
+    return (((uint64_t) 1) << 63) | ((uint64_t) depth << (ORDER*ORDER))
+        | (uint64_t) (filled & CELLS_ALL);
+}
+
+static inline unsigned tt_key_depth(const uint64_t key)
+{
+    return (key >> (ORDER*ORDER)) & 0x3f;
+}
+
+static inline struct tt_entry *tt_slot(const uint64_t key)
+{
+    return &tt[((key * 0x9e3779b97f4a7c15) >> 20) & tt_mask];
+}
+
+static void tt_init(void)
+{
+    size_t n = 1;
+
+    if (TT_MB == 0)
+        return;
+    while (n * 2 * sizeof(*tt) <= ((size_t) TT_MB << 20))
+        n *= 2;
+    tt = calloc(n, sizeof(*tt));
+    if (tt == NULL) {
+        fprintf(stderr, "calloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    tt_mask = n - 1;
+    printf("Transposition table: %zu entries (%zu MiB)\n",
+            n, n * sizeof(*tt) >> 20);
+}
+
+static inline int tt_probe(const uint64_t key, const score_t bound,
+        score_t *scorep)
+{
+    const struct tt_entry *e;
+    uint64_t check, lo, hi;
+    score_t score;
+
+    if (tt == NULL)
+        return 0;
+    e = tt_slot(key);
+    check = __atomic_load_n(&e->check, __ATOMIC_RELAXED);
+    lo = __atomic_load_n(&e->lo, __ATOMIC_RELAXED);
+    hi = __atomic_load_n(&e->hi, __ATOMIC_RELAXED);
+    score = ((score_t) hi << 64) | lo;
+    if ((check ^ lo ^ hi) != key
+            || ((score & TT_UPPER) && (score & ~TT_UPPER) > bound)) {
+        tt_misses ++;
+        return 0;
+    }
+    tt_hits ++;
+    *scorep = score & ~TT_UPPER;
+    return 1;
+}
+
+static inline void tt_store(const uint64_t key, const score_t score,
+        const score_t bound)
+{
+    struct tt_entry *e;
+    const score_t flagged = score > bound ? score : score | TT_UPPER;
+    const uint64_t lo = flagged, hi = flagged >> 64;
+
+    if (tt == NULL)
+        return;
+    e = tt_slot(key);
+    if (TT_POLICY == TT_POLICY_DEPTH) {
+        const uint64_t old = __atomic_load_n(&e->check, __ATOMIC_RELAXED)
+            ^ __atomic_load_n(&e->lo, __ATOMIC_RELAXED)
+            ^ __atomic_load_n(&e->hi, __ATOMIC_RELAXED);
+        if ((old >> 63) && tt_key_depth(old) < tt_key_depth(key))
+            return;
+    }
+    __atomic_store_n(&e->check, key ^ lo ^ hi, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->lo, lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->hi, hi, __ATOMIC_RELAXED);
+    tt_stores ++;
+}
+
+static void tt_report(void)
+{
+    uint64_t hits = 0, misses = 0, stores = 0;
+
+    if (tt == NULL)
+        return;
+#pragma omp parallel reduction(+:hits, misses, stores)
+    {
+        hits += tt_hits;
+        misses += tt_misses;
+        stores += tt_stores;
+    }
+    printf("Transposition table: %" PRIu64 " hits, %" PRIu64 " misses (hit rate %.1f%%), %"
+            PRIu64 " stores\n", hits, misses,
+            100.0 * hits / (hits + misses ? hits + misses : 1), stores);
+}
+
+#define SCORE_SHIFT(depth) (SCORE_BASE_SHIFT * (DEPTH_MAX - 1 - (depth)))
+
+static uint64_t bnb_pruned[DEPTH_MAX];
+#pragma omp threadprivate(bnb_pruned)
+
+/*
+ * An upper bound on the score of a node at depth whose own score_base is
+ * score_base and which leaves nempty cells to its children.  The children
+ * fill at most nempty cells in all, and if the next one fills them all
+ * nothing is left below it.
+ */
+static inline score_t bnb_upper(const unsigned depth,
+        const unsigned score_base, const unsigned nempty)
+{
+    score_t rest = (((score_t) 1) << SCORE_SHIFT(depth)) - 1;
+
+    if (BNB == BNB_CELLS && depth < DEPTH_MAX - 1
+            && ((score_t) nempty << SCORE_SHIFT(depth + 1)) < rest)
+        rest = (score_t) nempty << SCORE_SHIFT(depth + 1);
+    return ((score_t) score_base << SCORE_SHIFT(depth)) | rest;
+}
+
+static void bnb_report(void)
+{
+    uint64_t pruned[DEPTH_MAX] = {0};
+    unsigned depth;
+
+    if (BNB == BNB_NONE)
+        return;
+#pragma omp parallel private(depth)
+    for (depth = 0; depth < DEPTH_MAX; depth ++)
+#pragma omp atomic
+        pruned[depth] += bnb_pruned[depth];
+    printf("Branch-and-bound: pruned nodes per depth:\n");
+    for (depth = 0; depth < DEPTH_MAX; depth ++)
+        if (pruned[depth] != 0)
+            printf("depth=%2u: pruned=%" PRIu64 "\n", depth, pruned[depth]);
+}
+
+/*
+ * Return the score of the subtree at filled if it is larger than bound, or
+ * else an upper bound on it that is at most bound.  A caller only needs to
+ * know whether the subtree beats its incumbent, so a subtree that provably
+ * does not is cut off.
+ */
+static score_t best_order_recurse(binsquare_t filled, const unsigned depth,
+        const score_t bound)
 {
+    const uint64_t key = tt_key(filled, depth);
+    const unsigned nempty = popcount_bs(~filled);
     size_t i;
+    score_t score;
+
+    if (BNB == BNB_CELLS && bnb_upper(depth, nempty, 0) <= bound) {
+        bnb_pruned[depth] ++;
+        return bnb_upper(depth, nempty, 0);
+    }
+
+    if (tt_probe(key, bound, &score))
+        return score;
 
     binsquare_t bf, obv;
     binsquare_t best_sets_filled[ORDER*ORDER];
@@ -118,23 +802,14 @@ static score_t best_order_recurse(binsquare_t filled, const unsigned depth)
     for (bf = RIGHTMOST_0(filled); bf != 0;
             bf = NEXT_BF(bf, filled), obv = (binsquare_t) 0) {
 
-        filled |= bf;
-
-retry:
-        for (i = 0; i < BSLIST_LEN; i ++) {
-            binsquare_t tmp = ALONE_1(~filled & bslist[i]);
-            if (tmp) {
-                filled |= tmp;
-                obv |= tmp;
-                goto retry;
-            }
-        }
+        obv = prop_propagate(&filled, bf);
 
         const unsigned score_base = 1 + popcount_bs(obv);
 
         if (filled == (binsquare_t) -1) {
             assert(depth == DEPTH_MAX - 1);
-            return (score_t) score_base << (SCORE_BASE_SHIFT * (DEPTH_MAX - 1 - depth));
+            prop_undo(bf | obv);
+            return (score_t) score_base << SCORE_SHIFT(depth);
         }
 
         if (score_base > best_sets_score_base_best) {
@@ -145,6 +820,7 @@ retry:
             best_sets_filled[best_sets_len++] = filled;
 
         filled ^= bf | obv;
+        prop_undo(bf | obv);
     }
 
     assert(best_sets_len != 0);
@@ -156,33 +832,178 @@ retry:
     if (depth >= DEPTH_MAX - 1)
         return 0;
 
+    const score_t score_own =
+        (score_t) best_sets_score_base_best << SCORE_SHIFT(depth);
+
+    if (BNB != BNB_NONE) {
+        score = bnb_upper(depth, best_sets_score_base_best,
+                nempty - best_sets_score_base_best);
+        if (score <= bound) {
+            bnb_pruned[depth] ++;
+            tt_store(key, score, bound);
+            return score;
+        }
+    }
+
     if (depth <= 10)
         printf("depth=%2u: len=%2zu, best=%2d\n",
                 depth, best_sets_len, best_sets_score_base_best);
 
-    score_t score_base_children_best = 0;
+    /*
+     * The children are independent subtrees: near the root every one becomes
+     * an OpenMP task, which idle threads steal.  Their scores are collected
+     * per child and reduced in order after taskwait, so the result does not
+     * depend on the number of threads or on the schedule.  A child only
+     * matters if it beats bound_children: what this node still needs to beat
+     * bound and, when the children run one after another, the best sibling so
+     * far.
+     */
+    const int spawn = PROP_THREAD_SAFE && depth < TASK_DEPTH_MAX;
+    score_t bound_children = bound > score_own ? bound - score_own : 0;
+    score_t score_base_children[ORDER*ORDER];
     for (i = 0; i < best_sets_len; i ++) {
-        score_t score_base_children;
-        filled = best_sets_filled[i];
+#pragma omp task default(none) firstprivate(i, filled, depth, bound_children) \
+        shared(best_sets_filled, score_base_children) if(spawn)
+        {
+            prop_assign(best_sets_filled[i] & ~filled);
+            score_base_children[i] = best_order_recurse(best_sets_filled[i],
+                    depth + 1, bound_children);
+            prop_undo(best_sets_filled[i] & ~filled);
+        }
+        if (BNB != BNB_NONE && !spawn
+                && score_base_children[i] > bound_children)
+            bound_children = score_base_children[i];
+    }
+#pragma omp taskwait
 
-        score_base_children = best_order_recurse(filled, depth + 1);
-        if (score_base_children > score_base_children_best)
-            score_base_children_best = score_base_children;
+    score_t score_base_children_best = 0;
+    for (i = 0; i < best_sets_len; i ++)
+        if (score_base_children[i] > score_base_children_best)
+            score_base_children_best = score_base_children[i];
+
+    score = score_own | score_base_children_best;
+    tt_store(key, score, bound);
+    return score;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Microbenchmark of the scan kernels over the loaded bslist, from random
+ * partially filled states.  Every kernel must agree with the scalar one.
+ */
+static void bench_scan(void)
+{
+    enum { NSTATES = 256 };
+    binsquare_t states[NSTATES], all_ref[NSTATES];
+    size_t first_ref[NSTATES];
+    double time_ref[2] = {0, 0};
+    uint64_t x = 88172645463325252ULL;
+    size_t k, j, nscanned = 0;
+
+    for (j = 0; j < NSTATES; j ++) {
+        binsquare_t filled = ~CELLS_ALL;
+        const int n = j % (ORDER*ORDER);
+        int c;
+        for (c = 0; c < n; c ++) {
+            x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+            filled |= CELL_MASK(x % (ORDER*ORDER));
+        }
+        states[j] = filled;
+    }
+
+    for (k = SCAN_NKERNELS; k -- > 0; ) {
+        const struct scan_kernel *kern = &scan_kernels[k];
+        double t_all, t_first;
+
+        if (!scan_kernel_supported(kern)) {
+            printf("%-6s: not supported by this CPU\n", kern->name);
+            continue;
+        }
+
+        t_all = now();
+        for (j = 0; j < NSTATES; j ++) {
+            const binsquare_t forced = kern->all(bslist, BSLIST_LEN, states[j]);
+            if (kern->isa == NULL)
+                all_ref[j] = forced;
+            else if (forced != all_ref[j]) {
+                fprintf(stderr, "error: %s: scan_all differs from scalar\n", kern->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        t_all = now() - t_all;
+
+        t_first = now();
+        for (j = 0; j < NSTATES; j ++) {
+            const size_t first = kern->first(bslist, BSLIST_LEN, states[j]);
+            if (kern->isa == NULL) {
+                first_ref[j] = first;
+                nscanned += first < BSLIST_LEN ? first + 1 : BSLIST_LEN;
+            } else if (first != first_ref[j]) {
+                fprintf(stderr, "error: %s: scan_first differs from scalar\n", kern->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        t_first = now() - t_first;
+
+        if (kern->isa == NULL) {
+            time_ref[0] = t_all;
+            time_ref[1] = t_first;
+        }
+        printf("%-6s: all: %7.1f Mentries/s (%.2fx), first: %7.1f Mentries/s (%.2fx)\n",
+                kern->name,
+                (double) NSTATES * BSLIST_LEN / t_all * 1e-6, time_ref[0] / t_all,
+                nscanned / t_first * 1e-6, time_ref[1] / t_first);
     }
+}
 
-    return (best_sets_score_base_best
-            << (SCORE_BASE_SHIFT * (DEPTH_MAX - 1 - depth)))
-                    | score_base_children_best;
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--bench-scan]\n", argv0);
+    fprintf(stderr, "  --bench-scan  Compare the bslist scan kernels and exit\n");
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    static const struct option longopts[] = {
+        {"bench-scan", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt, do_bench_scan = 0;
+
     unsigned i;
     binsquare_t filled = ~((1 << (ORDER*ORDER)) - 1);
 
-    bslist = bslist_load();
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                do_bench_scan = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
-    score_t score = best_order_recurse(filled, 0);
+    bslist = bslist_load();
+    if (do_bench_scan) {
+        bench_scan();
+        return 0;
+    }
+    prop_init(filled);
+    tt_init();
+
+    score_t score;
+#pragma omp parallel
+#pragma omp single
+    score = best_order_recurse(filled, 0, 0);
+    tt_report();
+    bnb_report();
 
     printf("Result:\n");
     for (i = 0; i < DEPTH_MAX; i ++, score >>= SCORE_BASE_SHIFT)
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * Huge-page backed bsmap allocation.
+ *
+ * The bsmap is probed at random, and an ORDER=6 one is 8 GiB, so with 4 KiB
+ * pages nearly every probe also misses the TLB.  bsmap_alloc() maps zeroed
+ * anonymous memory with the requested page size and falls back to the next
+ * smaller one if it cannot get it:
+ *
+ *   1g    1 GiB hugetlbfs pages (reserved with hugepagesz=1G hugepages=N)
+ *   2m    2 MiB hugetlbfs pages (vm.nr_hugepages)
+ *   thp   2 MiB aligned memory with MADV_HUGEPAGE (the default)
+ *   none  plain 4 KiB pages
+ *
+ * Only the pages a run touches are ever backed, so the 4 KiB and THP maps
+ * are MAP_NORESERVE: a small coefficient range does not need 8 GiB of
+ * commit charge.  bsmap_free() releases a map.
+ */
+
+#ifndef BSMAP_ALLOC_H
+#define BSMAP_ALLOC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+enum bsmap_pages {
+    BSMAP_PAGES_1G,
+    BSMAP_PAGES_2M,
+    BSMAP_PAGES_THP,
+    BSMAP_PAGES_NONE,
+};
+
+static const char *const bsmap_pages_names[] = {
+    [BSMAP_PAGES_1G]   = "1g",
+    [BSMAP_PAGES_2M]   = "2m",
+    [BSMAP_PAGES_THP]  = "thp",
+    [BSMAP_PAGES_NONE] = "none",
+};
+
+/* Return non-zero if str is not one of bsmap_pages_names. */
+static inline int bsmap_pages_parse(const char *str, enum bsmap_pages *pages)
+{
+    int i;
+
+    for (i = BSMAP_PAGES_1G; i <= BSMAP_PAGES_NONE; i ++) {
+        if (!strcmp(str, bsmap_pages_names[i])) {
+            *pages = (enum bsmap_pages) i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline void* bsmap_mmap(const size_t size, const int flags)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Size of the pages that back a map allocated with pages. */
+static inline size_t bsmap_pages_size(const enum bsmap_pages pages)
+{
+    switch (pages) {
+        case BSMAP_PAGES_1G:
+            return ((size_t) 1) << 30;
+        case BSMAP_PAGES_2M:
+        case BSMAP_PAGES_THP:
+            return ((size_t) 1) << 21;
+        default:
+            return ((size_t) 1) << 12;
+    }
+}
+
+/*
+ * Return size bytes of zeroed memory backed by pages as large as pages
+ * allows, and store the page size actually used to *gotp.  Return NULL with
+ * errno set if not even 4 KiB pages are available.
+ */
+static void* bsmap_alloc(const size_t size, enum bsmap_pages pages,
+        enum bsmap_pages *gotp)
+{
+    const size_t huge = ((size_t) 1) << 21, giant = ((size_t) 1) << 30;
+    void *p = NULL;
+
+    for (; pages <= BSMAP_PAGES_NONE; pages ++) {
+        switch (pages) {
+            case BSMAP_PAGES_1G:
+                p = bsmap_mmap((size + giant - 1) & ~(giant - 1),
+                        MAP_HUGETLB | (30 << MAP_HUGE_SHIFT));
+                break;
+            case BSMAP_PAGES_2M:
+                p = bsmap_mmap((size + huge - 1) & ~(huge - 1),
+                        MAP_HUGETLB | (21 << MAP_HUGE_SHIFT));
+                break;
+            case BSMAP_PAGES_THP: {
+                /* Over-map so that the huge pages line up with the map. */
+                const size_t len = (size + 4095) & ~(size_t) 4095;
+                uint8_t *q = bsmap_mmap(len + huge, MAP_NORESERVE);
+                if (q == NULL)
+                    break;
+                p = (void*) (((uintptr_t) q + huge - 1) & ~(uintptr_t) (huge - 1));
+                /* Trim the over-map so that bsmap_free() can unmap [p, p+len). */
+                if ((uint8_t*) p != q)
+                    (void) munmap(q, (uint8_t*) p - q);
+                (void) munmap((uint8_t*) p + len, q + huge - (uint8_t*) p);
+                if (madvise(p, size, MADV_HUGEPAGE)) {
+                    fprintf(stderr, "bsmap_alloc: madvise(MADV_HUGEPAGE): %s\n",
+                            strerror(errno));
+                    pages = BSMAP_PAGES_NONE;
+                }
+                break;
+            }
+            case BSMAP_PAGES_NONE:
+                p = bsmap_mmap(size, MAP_NORESERVE);
+                break;
+        }
+        if (p != NULL) {
+            *gotp = pages;
+            return p;
+        }
+        if (pages != BSMAP_PAGES_NONE) {
+            const int err = errno;
+            fprintf(stderr, "bsmap_alloc: No %s pages (%s), falling back\n",
+                    bsmap_pages_names[pages], strerror(err));
+            errno = err;
+        }
+    }
+    return NULL;
+}
+
+/* Release a map of size bytes that bsmap_alloc() returned with pages. */
+static inline void bsmap_free(void *p, const size_t size, const enum bsmap_pages pages)
+{
+    /* Only the hugetlbfs maps are whole pages; the others end on 4 KiB. */
+    const size_t align = pages == BSMAP_PAGES_1G ? ((size_t) 1) << 30
+            : pages == BSMAP_PAGES_2M ? ((size_t) 1) << 21 : ((size_t) 1) << 12;
+
+    if (munmap(p, (size + align - 1) & ~(align - 1))) {
+        fprintf(stderr, "bsmap_free: munmap: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+#endif /* BSMAP_ALLOC_H */
@@ -8,101 +8,399 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <immintrin.h>
+#include <omp.h>
 
-static uint64_t* gather(uint64_t *sum, const char *filename, size_t *sizep)
+#include "bsmapz.h"
+
+/*
+ * The inputs are mmap'ed and ORed together chunk by chunk: every chunk of the
+ * output is produced from the same chunk of all inputs in one pass, and its
+ * popcount is taken while it is still in the registers.  A batch of one chunk
+ * per thread is gathered in parallel and then written out in order, so the
+ * inputs are read once, the output map is never held in memory as a whole and
+ * the run is bound by the disk.
+ */
+#define GATHER_CHUNK_SIZE (((size_t) 1) << 24)
+
+struct input {
+    const char *filename;
+    const uint64_t *p;
+};
+
+static void input_map(struct input *input, const char *filename, size_t *sizep)
 {
-    size_t i;
-    FILE *fp;
     struct stat sb;
-    uint64_t *p;
-    size_t rets;
+    int fd;
+    void *p;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "open: %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    if (lstat(filename, &sb)) {
-        fprintf(stderr, "lstat: %s: %s\n", filename, strerror(errno));
+    if (fstat(fd, &sb)) {
+        fprintf(stderr, "fstat: %s: %s\n", filename, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    if (*sizep != 0 && sb.st_size != *sizep) {
+    if (*sizep != 0 && (size_t) sb.st_size != *sizep) {
         fprintf(stderr, "size is different\n");
         exit(EXIT_FAILURE);
     }
+    if (sb.st_size == 0 || sb.st_size % sizeof(uint64_t) != 0) {
+        fprintf(stderr, "error: %s: Invalid bsmap size\n", filename);
+        exit(EXIT_FAILURE);
+    }
 
     *sizep = sb.st_size;
 
-    p = calloc(*sizep, 1);
-    if (p == NULL) {
-        fprintf(stderr, "calloc: %s\n", strerror(errno));
+    p = mmap(NULL, *sizep, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s: %s\n", filename, strerror(errno));
         exit(EXIT_FAILURE);
     }
+    (void) madvise(p, *sizep, MADV_SEQUENTIAL);
 
-    fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
+    if (close(fd)) {
+        fprintf(stderr, "close: %s: %s\n", filename, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    rets = fread(p, 1, *sizep, fp);
-    if (rets != *sizep) {
-        fprintf(stderr, "fread: %s: %s\n", filename, strerror(errno));
-        exit(EXIT_FAILURE);
+    input->filename = filename;
+    input->p = p;
+}
+
+/* OR words [begin, end) of all inputs into out and return their popcount. */
+static uint64_t gather_chunk(uint64_t *out, const struct input *inputs,
+        const int ninputs, const size_t begin, const size_t end)
+{
+    uint64_t *sum = out - begin;
+    uint64_t count = 0;
+    size_t i = begin;
+    int j;
+
+#if defined(__AVX512F__)
+    for (; i + 8 <= end; i += 8) {
+        __m512i v = _mm512_loadu_si512(inputs[0].p + i);
+        for (j = 1; j < ninputs; j ++)
+            v = _mm512_or_si512(v, _mm512_loadu_si512(inputs[j].p + i));
+        _mm512_storeu_si512(sum + i, v);
+#if defined(__AVX512VPOPCNTDQ__)
+        count += _mm512_reduce_add_epi64(_mm512_popcnt_epi64(v));
+#else
+        for (j = 0; j < 8; j ++)
+            count += __builtin_popcountll(sum[i + j]);
+#endif
+    }
+#elif defined(__AVX2__)
+    for (; i + 4 <= end; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (inputs[0].p + i));
+        for (j = 1; j < ninputs; j ++)
+            v = _mm256_or_si256(v,
+                    _mm256_loadu_si256((const __m256i*) (inputs[j].p + i)));
+        _mm256_storeu_si256((__m256i*) (sum + i), v);
+        count += __builtin_popcountll(_mm256_extract_epi64(v, 0))
+            + __builtin_popcountll(_mm256_extract_epi64(v, 1))
+            + __builtin_popcountll(_mm256_extract_epi64(v, 2))
+            + __builtin_popcountll(_mm256_extract_epi64(v, 3));
+    }
+#endif
+    for (; i < end; i ++) {
+        uint64_t u = inputs[0].p[i];
+        for (j = 1; j < ninputs; j ++)
+            u |= inputs[j].p[i];
+        sum[i] = u;
+        count += __builtin_popcountll(u);
     }
 
-    if (fclose(fp)) {
-        fprintf(stderr, "close: %s: %s\n", filename, strerror(errno));
+    /* The pages of this chunk will not be read again; chunks are page-aligned. */
+    for (j = 0; j < ninputs; j ++)
+        (void) madvise((void*) (inputs[j].p + begin),
+                (end - begin) * sizeof(uint64_t), MADV_DONTNEED);
+
+    return count;
+}
+
+static uint64_t gather(const struct input *inputs, const int ninputs,
+        const size_t size, FILE *fp)
+{
+    const size_t nwords = size / sizeof(uint64_t);
+    const size_t chunk_words = GATHER_CHUNK_SIZE / sizeof(uint64_t);
+    const size_t batch_words = chunk_words * omp_get_max_threads();
+    uint64_t *buf, count = 0;
+    size_t batch, i;
+
+    buf = malloc(batch_words * sizeof(*buf));
+    if (buf == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    if (sum == NULL)
-        return p;
+    for (batch = 0; batch < nwords; batch += batch_words) {
+        const size_t batch_end =
+            (batch + batch_words < nwords) ? batch + batch_words : nwords;
 
-    for (i = 0; i < *sizep / sizeof(*sum); i ++)
-        sum[i] |= p[i];
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:count)
+        for (i = batch; i < batch_end; i += chunk_words)
+            count += gather_chunk(buf + (i - batch), inputs, ninputs, i,
+                    (i + chunk_words < batch_end) ? i + chunk_words : batch_end);
 
-    free(p);
+        if (fp != NULL) {
+            const size_t rets = fwrite(buf, sizeof(*buf), batch_end - batch, fp);
+            if (rets != batch_end - batch) {
+                fprintf(stderr, "fwrite: stdout: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
 
-    return NULL;
+    free(buf);
+
+    return count;
 }
 
-static uint32_t count_innovative(unsigned long long *sum, const size_t size)
+/*
+ * Compressed inputs are merged container by container: the containers of all
+ * inputs are read in key order and those with the smallest key are ORed into
+ * one container-sized scratch bitmap, which is written out again.  Only one
+ * container per input is held in memory.
+ */
+struct zinput {
+    const char *filename;
+    FILE *fp;
+    uint64_t count;
+    struct bsmapz_container c;
+};
+
+static void zinput_open(struct zinput *input, const char *filename,
+        struct bsmapz_header *header)
 {
-    size_t i;
-    uint32_t count = 0;
-    for (i = 0; i < size / sizeof(*sum); i ++)
-        count += __builtin_popcountll(sum[i]);
+    struct bsmapz_header h;
+
+    input->fp = fopen(filename, "rb");
+    if (input->fp == NULL) {
+        fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    input->filename = filename;
+    input->count = 0;
+
+    bsmapz_fread(&h, sizeof(h), input->fp, filename);
+    if (!bsmapz_header_valid(header))
+        *header = h;
+    else if (h.order != header->order || h.coeff_min != header->coeff_min
+            || h.coeff_max != header->coeff_max || h.flags != header->flags) {
+        fprintf(stderr, "error: %s: Header differs (ORDER %" PRIu32 ", [%" PRId32
+                ", %" PRId32 "], flags %#" PRIx32 ")\n", filename, h.order,
+                h.coeff_min, h.coeff_max, h.flags);
+        exit(EXIT_FAILURE);
+    }
+
+    (void) bsmapz_read_container(input->fp, filename, &input->c, &input->count);
+}
+
+static uint64_t zgather(struct zinput *inputs, const int ninputs, FILE *fp)
+{
+    static uint64_t words[BSMAPZ_CONTAINER_WORDS];
+    struct bsmapz_header header;
+    uint64_t count = 0;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+    for (i = 0; i < ninputs; i ++)
+        zinput_open(&inputs[i], inputs[i].filename, &header);
+    if (fp != NULL)
+        bsmapz_write_header(fp, "stdout", &header);
+
+    for (;;) {
+        uint32_t key = BSMAPZ_KEY_END;
+        for (i = 0; i < ninputs; i ++)
+            if (inputs[i].c.key < key)
+                key = inputs[i].c.key;
+        if (key == BSMAPZ_KEY_END)
+            break;
+
+        memset(words, 0, sizeof(words));
+        for (i = 0; i < ninputs; i ++) {
+            if (inputs[i].c.key != key)
+                continue;
+            bsmapz_or_into(words, &inputs[i].c);
+            (void) bsmapz_read_container(inputs[i].fp, inputs[i].filename,
+                    &inputs[i].c, &inputs[i].count);
+        }
+
+        if (fp != NULL)
+            count += bsmapz_write_words(fp, "stdout", key, words);
+        else
+            for (i = 0; i < BSMAPZ_CONTAINER_WORDS; i ++)
+                count += __builtin_popcountll(words[i]);
+    }
+
+    if (fp != NULL)
+        bsmapz_write_end(fp, "stdout", count);
+
+    for (i = 0; i < ninputs; i ++) {
+        if (fclose(inputs[i].fp)) {
+            fprintf(stderr, "fclose: %s: %s\n", inputs[i].filename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
     return count;
 }
 
+/* Return non-zero if filename is a compressed bsmap. */
+static int is_bsmapz(const char *filename)
+{
+    struct bsmapz_header header;
+    FILE *fp;
+    int ret;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen: %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ret = fread(&header, sizeof(header), 1, fp) == 1
+        && bsmapz_header_valid(&header);
+    if (fclose(fp)) {
+        fprintf(stderr, "fclose: %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+/*
+ * Fragments written with --shard I/N carry ".shardIofN" in their name.  Either
+ * no file or every file must carry one; all of them must share the same base
+ * name and N, and every shard 0..N-1 must be present, otherwise the union
+ * would silently miss part of the coefficient space.  A shard may come in
+ * several files (per-thread fragments).
+ */
+static void check_shards(const int nfiles, char *filenames[])
+{
+    const char *base = NULL;
+    size_t base_len = 0;
+    unsigned nshards = 0, nseen = 0;
+    unsigned char *seen = NULL;
+    int i, nplain = 0;
+
+    for (i = 0; i < nfiles; i ++) {
+        const char *p = strstr(filenames[i], ".shard");
+        unsigned shard, n;
+        if (p == NULL) {
+            nplain ++;
+            continue;
+        }
+        if (sscanf(p, ".shard%uof%u", &shard, &n) != 2
+                || n == 0 || shard >= n) {
+            fprintf(stderr, "error: %s: Invalid shard suffix\n", filenames[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (base == NULL) {
+            base = filenames[i];
+            base_len = p - filenames[i];
+            nshards = n;
+            seen = calloc(nshards, 1);
+            if (seen == NULL) {
+                fprintf(stderr, "calloc: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        } else if ((size_t) (p - filenames[i]) != base_len
+                || memcmp(filenames[i], base, base_len) || n != nshards) {
+            fprintf(stderr, "error: %s: Shard does not belong to %.*s (of %u)\n",
+                    filenames[i], (int) base_len, base, nshards);
+            exit(EXIT_FAILURE);
+        }
+        if (!seen[shard]) {
+            seen[shard] = 1;
+            nseen ++;
+        }
+    }
+
+    if (base == NULL)
+        return;
+    if (nplain != 0) {
+        fprintf(stderr, "error: Mixing sharded and unsharded bsmap files\n");
+        exit(EXIT_FAILURE);
+    }
+    if (nseen != nshards) {
+        fprintf(stderr, "error: Missing shard(s) of %.*s:", (int) base_len, base);
+        for (i = 0; i < (int) nshards; i ++)
+            if (!seen[i])
+                fprintf(stderr, " %d", i);
+        fprintf(stderr, " (of %u)\n", nshards);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "All %u shard(s) present\n", nshards);
+    free(seen);
+}
+
 int main(int argc, char *argv[])
 {
-    void *sum;
-    int i;
+    int i, nz;
     size_t size = 0;
-    uint32_t count;
+    uint64_t count;
 
     if (argc <= 1) {
         fprintf(stderr, "error: Specify bsmap files\n");
         exit(EXIT_FAILURE);
     }
+    check_shards(argc - 1, argv + 1);
     fprintf(stderr, "Gathering %d file(s)\n", argc - 1);
 
-    sum = gather(NULL, argv[1], &size);
-    for (i = 2; i < argc; i ++)
-        gather(sum, argv[i], &size);
-
-    count = count_innovative(sum, size);
-    fprintf(stderr, "innovative_count = %" PRIu32 "\n", count);
+    nz = 0;
+    for (i = 1; i < argc; i ++)
+        nz += is_bsmapz(argv[i]);
+    if (nz != 0 && nz != argc - 1) {
+        fprintf(stderr, "error: Mixing dense and compressed bsmap files\n");
+        exit(EXIT_FAILURE);
+    }
 
-    if (!isatty(STDOUT_FILENO)) {
+    if (!isatty(STDOUT_FILENO))
         fprintf(stderr, "Writing gathered bsmap to stdout\n");
-        size_t rets = fwrite(sum, 1, size, stdout);
-        if (rets != size) {
-            fprintf(stderr, "fwrite: stdout: %s\n", strerror(errno));
+
+    if (nz != 0) {
+        struct zinput *zinputs = calloc(argc - 1, sizeof(*zinputs));
+        if (zinputs == NULL) {
+            fprintf(stderr, "calloc: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
-    } else
-        printf("Redirect stdout to file to output gathered bsmap\n");
+        for (i = 1; i < argc; i ++)
+            zinputs[i - 1].filename = argv[i];
+        count = zgather(zinputs, argc - 1, isatty(STDOUT_FILENO) ? NULL : stdout);
+        free(zinputs);
+    } else {
+        struct input *inputs = calloc(argc - 1, sizeof(*inputs));
+        if (inputs == NULL) {
+            fprintf(stderr, "calloc: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 1; i < argc; i ++)
+            input_map(&inputs[i - 1], argv[i], &size);
+
+        count = gather(inputs, argc - 1, size,
+                isatty(STDOUT_FILENO) ? NULL : stdout);
 
-    free(sum);
+        for (i = 0; i < argc - 1; i ++) {
+            if (munmap((void*) inputs[i].p, size)) {
+                fprintf(stderr, "munmap: %s: %s\n", inputs[i].filename, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(inputs);
+    }
+
+    fprintf(stderr, "innovative_count = %" PRIu64 "\n", count);
+    if (isatty(STDOUT_FILENO))
+        printf("Redirect stdout to file to output gathered bsmap\n");
+    else if (fflush(stdout)) {
+        fprintf(stderr, "fflush: stdout: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     return 0;
 }
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * NUMA placement of the bsmap and pinning of the threads, with raw mbind(2)
+ * and sched_setaffinity(2) so that libnuma is not needed.
+ *
+ *   none        first touch (the default)
+ *   interleave  pages round-robin over the nodes
+ *   partition   the k-th of M equal address ranges on the k-th node
+ *
+ * Only nodes with CPUs count.  bsmap_numa_pin() puts thread t of N on node
+ * t * M / N, so with partition and M dividing N the contiguous range each
+ * --sharded owner thread is given lies on its own node: every binsquare is
+ * then routed to, and checked by, a thread local to its part of the map.
+ */
+
+#ifndef BSMAP_NUMA_H
+#define BSMAP_NUMA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define BSMAP_NUMA_MAX_NODES 64
+#define BSMAP_MPOL_BIND       2
+#define BSMAP_MPOL_INTERLEAVE 3
+
+enum bsmap_numa {
+    BSMAP_NUMA_NONE,
+    BSMAP_NUMA_INTERLEAVE,
+    BSMAP_NUMA_PARTITION,
+};
+
+static const char *const bsmap_numa_names[] = {
+    [BSMAP_NUMA_NONE]       = "none",
+    [BSMAP_NUMA_INTERLEAVE] = "interleave",
+    [BSMAP_NUMA_PARTITION]  = "partition",
+};
+
+static struct {
+    int nnodes;
+    int node[BSMAP_NUMA_MAX_NODES];  /* Node numbers */
+    int ncpus[BSMAP_NUMA_MAX_NODES];
+    int *cpus[BSMAP_NUMA_MAX_NODES]; /* [ncpus[k]] */
+} bsmap_numa;
+
+/* Return non-zero if str is not one of bsmap_numa_names. */
+static inline int bsmap_numa_parse(const char *str, enum bsmap_numa *numa)
+{
+    int i;
+
+    for (i = BSMAP_NUMA_NONE; i <= BSMAP_NUMA_PARTITION; i ++) {
+        if (!strcmp(str, bsmap_numa_names[i])) {
+            *numa = (enum bsmap_numa) i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Read a sysfs list such as "0-3,8-11" into a malloc'ed array and return its
+ * length, or -1 if the file cannot be read.
+ */
+static int bsmap_numa_read_list(const char *path, int **listp)
+{
+    FILE *fp = fopen(path, "r");
+    int *list = NULL, n = 0, lo, hi, c;
+
+    if (fp == NULL)
+        return -1;
+    while (fscanf(fp, "%d", &lo) == 1) {
+        hi = lo;
+        if ((c = fgetc(fp)) == '-') {
+            if (fscanf(fp, "%d", &hi) != 1)
+                break;
+            c = fgetc(fp);
+        }
+        list = realloc(list, sizeof(*list) * (n + hi - lo + 1));
+        if (list == NULL) {
+            fprintf(stderr, "realloc: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (; lo <= hi; lo ++)
+            list[n ++] = lo;
+        if (c != ',')
+            break;
+    }
+    (void) fclose(fp);
+    *listp = list;
+    return n;
+}
+
+/* Find the nodes with CPUs; a machine without sysfs node info is one node. */
+static void bsmap_numa_init(void)
+{
+    int *nodes = NULL, nnodes, i;
+    char path[0x80];
+
+    bsmap_numa.nnodes = 0;
+    nnodes = bsmap_numa_read_list("/sys/devices/system/node/online", &nodes);
+    for (i = 0; i < nnodes && bsmap_numa.nnodes < BSMAP_NUMA_MAX_NODES; i ++) {
+        const int k = bsmap_numa.nnodes;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                nodes[i]);
+        bsmap_numa.ncpus[k] = bsmap_numa_read_list(path, &bsmap_numa.cpus[k]);
+        if (bsmap_numa.ncpus[k] <= 0)
+            continue;
+        bsmap_numa.node[k] = nodes[i];
+        bsmap_numa.nnodes ++;
+    }
+    free(nodes);
+
+    if (bsmap_numa.nnodes == 0) {
+        const int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        bsmap_numa.nnodes = 1;
+        bsmap_numa.node[0] = 0;
+        bsmap_numa.ncpus[0] = ncpus;
+        bsmap_numa.cpus[0] = malloc(sizeof(int) * ncpus);
+        if (bsmap_numa.cpus[0] == NULL) {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < ncpus; i ++)
+            bsmap_numa.cpus[0][i] = i;
+    }
+}
+
+/* Apply the memory policy mode on nodes (bitmask of indices) to [p, p+len). */
+static int bsmap_numa_mbind(void *p, const size_t len, const int mode,
+        const uint64_t nodes)
+{
+    unsigned long mask[BSMAP_NUMA_MAX_NODES / 64 + 1] = {0};
+    int k;
+
+    for (k = 0; k < bsmap_numa.nnodes; k ++)
+        if (nodes & (((uint64_t) 1) << k))
+            mask[bsmap_numa.node[k] / 64] |= 1UL << (bsmap_numa.node[k] % 64);
+    return syscall(SYS_mbind, p, len, mode, mask, sizeof(mask) * 8, 0);
+}
+
+/*
+ * Place the not yet touched map of size bytes; align is the page size the
+ * map is backed with.  Failures only lose the placement and are reported.
+ */
+static void bsmap_numa_place(void *map, const size_t size, const size_t align,
+        const enum bsmap_numa numa)
+{
+    const int m = bsmap_numa.nnodes;
+    int k;
+
+    if (numa == BSMAP_NUMA_NONE || m < 2)
+        return;
+    if (numa == BSMAP_NUMA_INTERLEAVE) {
+        if (bsmap_numa_mbind(map, size, BSMAP_MPOL_INTERLEAVE,
+                    (((uint64_t) 1) << m) - 1))
+            fprintf(stderr, "bsmap_numa: mbind(MPOL_INTERLEAVE): %s\n",
+                    strerror(errno));
+        return;
+    }
+    for (k = 0; k < m; k ++) {
+        const size_t lo = size / m * k & ~(align - 1);
+        const size_t hi = k == m - 1 ? size : size / m * (k + 1) & ~(align - 1);
+        if (bsmap_numa_mbind((char*) map + lo, hi - lo, BSMAP_MPOL_BIND,
+                    ((uint64_t) 1) << k))
+            fprintf(stderr, "bsmap_numa: mbind(MPOL_BIND) of [%zu, %zu) to node %d: %s\n",
+                    lo, hi, bsmap_numa.node[k], strerror(errno));
+    }
+}
+
+/* Index into bsmap_numa of the node thread tid of nthreads is pinned to. */
+static inline int bsmap_numa_node_of(const int tid, const int nthreads)
+{
+    return (int) ((long) tid * bsmap_numa.nnodes / nthreads);
+}
+
+/* Pin the calling thread, tid of nthreads, to one CPU of its node. */
+static void bsmap_numa_pin(const int tid, const int nthreads)
+{
+    const int k = bsmap_numa_node_of(tid, nthreads);
+    const int first = (int) (((long) k * nthreads + bsmap_numa.nnodes - 1)
+            / bsmap_numa.nnodes);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(bsmap_numa.cpus[k][(tid - first) % bsmap_numa.ncpus[k]], &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        fprintf(stderr, "bsmap_numa: sched_setaffinity: %s\n", strerror(errno));
+}
+
+#endif /* BSMAP_NUMA_H */
@@ -8,6 +8,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#include "bsmapz.h"
 
 #if !defined(ORDER)
 #error "Define ORDER"
@@ -20,35 +24,215 @@ typedef uint64_t binsquare_t;
 #error "Unsupported ORDER specified"
 #endif
 
-static void bsmap_to_bslist(void)
+/*
+ * Set bits are extracted a word at a time with tzcnt/blsr into large output
+ * buffers.  A dense map is processed in batches of one chunk per thread: the
+ * chunks of a batch are extracted in parallel, each into its own buffer sized
+ * by a popcount pass, and the buffers are written out in order.  The input is
+ * mmap'ed when stdin is a regular file and read chunk by chunk otherwise.
+ */
+#define CHUNK_WORDS (((size_t) 1) << 17) /* 1 MiB */
+
+struct outbuf {
+    binsquare_t *p;
+    size_t len, cap;
+};
+
+static void outbuf_reserve(struct outbuf *buf, const size_t cap)
 {
-    uint64_t u;
-    size_t i, j, cnt = 0;
-    for (i = 0; ; i ++) {
-        const size_t rets = fread(&u, sizeof(u), 1, stdin);
-        if (rets != 1) {
-            if (feof(stdin))
-                break;
-            fprintf(stderr, "rets (%zu) != 1\n", rets);
-            fprintf(stderr, "fread: %s\n", strerror(errno));
+    if (cap <= buf->cap)
+        return;
+    buf->p = realloc(buf->p, cap * sizeof(*buf->p));
+    if (buf->p == NULL) {
+        fprintf(stderr, "realloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    buf->cap = cap;
+}
+
+static void outbuf_flush(struct outbuf *buf, size_t *cntp)
+{
+    const size_t rets = fwrite(buf->p, sizeof(*buf->p), buf->len, stdout);
+    if (rets != buf->len) {
+        fprintf(stderr, "fwrite: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    *cntp += buf->len;
+    buf->len = 0;
+}
+
+/* Append the bits of words, which hold binsquares from base on, to buf. */
+static inline void extract_words(struct outbuf *buf, const uint64_t *words,
+        const size_t nwords, const binsquare_t base)
+{
+    binsquare_t *p = buf->p + buf->len;
+    size_t i;
+
+    for (i = 0; i < nwords; i ++) {
+        uint64_t u = words[i];
+        const binsquare_t b = base + i * 64;
+        while (u) {
+            *p ++ = b | __builtin_ctzll(u);
+            u &= u - 1;
+        }
+    }
+    buf->len = p - buf->p;
+}
+
+static size_t popcount_words(const uint64_t *words, const size_t nwords)
+{
+    size_t i, count = 0;
+    for (i = 0; i < nwords; i ++)
+        count += __builtin_popcountll(words[i]);
+    return count;
+}
+
+static void bsmapz_to_bslist(const struct bsmapz_header *header, size_t *cntp)
+{
+    static struct bsmapz_container c;
+    struct outbuf buf = {NULL, 0, 0};
+    uint64_t count = 0;
+    uint32_t i;
+
+    if (header->order != ORDER) {
+        fprintf(stderr, "error: bsmap is for ORDER=%" PRIu32 ", not %d\n",
+                header->order, ORDER);
+        exit(EXIT_FAILURE);
+    }
+
+    outbuf_reserve(&buf, CHUNK_WORDS);
+    while (bsmapz_read_container(stdin, "stdin", &c, &count)) {
+        const binsquare_t base = ((binsquare_t) c.key) << BSMAPZ_CONTAINER_SHIFT;
+        if (buf.len + c.card > buf.cap)
+            outbuf_flush(&buf, cntp);
+        if (bsmapz_is_array(c.card)) {
+            for (i = 0; i < c.card; i ++)
+                buf.p[buf.len + i] = base | c.array[i];
+            buf.len += c.card;
+        } else
+            extract_words(&buf, c.words, BSMAPZ_CONTAINER_WORDS, base);
+        /* Exclude the null binsquare. */
+        if (base == 0 && buf.p[0] == 0) {
+            memmove(buf.p, buf.p + 1, (buf.len - 1) * sizeof(*buf.p));
+            buf.len --;
+        }
+    }
+    outbuf_flush(&buf, cntp);
+    free(buf.p);
+}
+
+/*
+ * Extract the dense map of nwords words.  head holds its first nhead words,
+ * which have already been read from stdin; map is the whole of it if stdin
+ * could be mmap'ed and NULL otherwise.
+ */
+static void dense_to_bslist(const uint64_t *head, const size_t nhead,
+        const uint64_t *map, size_t nwords, size_t *cntp)
+{
+    const size_t batch_words = CHUNK_WORDS * omp_get_max_threads();
+    struct outbuf *bufs;
+    uint64_t *rbuf = NULL;
+    size_t batch;
+    int t;
+
+    bufs = calloc(omp_get_max_threads(), sizeof(*bufs));
+    if (bufs == NULL) {
+        fprintf(stderr, "calloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (map == NULL) {
+        rbuf = malloc(batch_words * sizeof(*rbuf));
+        if (rbuf == NULL) {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
-        for (j = 0; j < sizeof(u) * 8; j ++) {
-            const __typeof__(u) m = ((__typeof__(u)) 1) << j;
+        nwords = SIZE_MAX;
+    }
+
+    for (batch = 0; batch < nwords; batch += batch_words) {
+        const uint64_t *words;
+        size_t len = (nwords - batch < batch_words) ? nwords - batch : batch_words;
+        size_t i;
+
+        if (map != NULL)
+            words = map + batch;
+        else {
+            const size_t n = (batch == 0) ? nhead : 0;
+            memcpy(rbuf, head, n * sizeof(*rbuf));
+            len = n + fread(rbuf + n, sizeof(*rbuf), len - n, stdin);
+            if (ferror(stdin)) {
+                fprintf(stderr, "fread: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (len == 0)
+                break;
+            words = rbuf;
+        }
+
+#pragma omp parallel for schedule(static, 1)
+        for (i = 0; i < len; i += CHUNK_WORDS) {
+            struct outbuf *buf = &bufs[i / CHUNK_WORDS];
+            const size_t n = (len - i < CHUNK_WORDS) ? len - i : CHUNK_WORDS;
+            buf->len = 0;
+            outbuf_reserve(buf, popcount_words(words + i, n));
+            extract_words(buf, words + i, n, (batch + i) * 64);
+        }
+
+        for (t = 0; t * CHUNK_WORDS < len; t ++) {
             /* Exclude the null binsquare. */
-            if (i == 0 && j == 0)
-                continue;
-            if (u & m) {
-                const binsquare_t bs = (i * sizeof(u) * 8) | j;
-                const size_t rets = fwrite(&bs, sizeof(bs), 1, stdout);
-                if (rets != 1) {
-                    fprintf(stderr, "fwrite: %s\n", strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                cnt ++;
+            if (batch == 0 && t == 0 && bufs[0].len != 0 && bufs[0].p[0] == 0) {
+                memmove(bufs[0].p, bufs[0].p + 1, (bufs[0].len - 1) * sizeof(*bufs[0].p));
+                bufs[0].len --;
             }
+            outbuf_flush(&bufs[t], cntp);
         }
+
+        if (map == NULL && len < batch_words)
+            break;
     }
+
+    for (t = 0; t < omp_get_max_threads(); t ++)
+        free(bufs[t].p);
+    free(bufs);
+    free(rbuf);
+}
+
+static void bsmap_to_bslist(void)
+{
+    union {
+        struct bsmapz_header header;
+        uint64_t u[sizeof(struct bsmapz_header) / sizeof(uint64_t)];
+    } head;
+    struct stat sb;
+    size_t cnt = 0;
+
+    if (fstat(STDIN_FILENO, &sb)) {
+        fprintf(stderr, "fstat: stdin: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* A compressed bsmap starts with its magic; anything else is dense. */
+    if (fread(&head, sizeof(head), 1, stdin) != 1) {
+        fprintf(stderr, "fread: %s\n", feof(stdin) ? "Too short" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (bsmapz_header_valid(&head.header))
+        bsmapz_to_bslist(&head.header, &cnt);
+    else if (S_ISREG(sb.st_mode) && sb.st_size % sizeof(uint64_t) == 0) {
+        void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "mmap: stdin: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        (void) madvise(map, sb.st_size, MADV_SEQUENTIAL);
+        dense_to_bslist(NULL, 0, map, sb.st_size / sizeof(uint64_t), &cnt);
+        if (munmap(map, sb.st_size)) {
+            fprintf(stderr, "munmap: stdin: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else
+        dense_to_bslist(head.u, sizeof(head.u) / sizeof(head.u[0]), NULL, 0, &cnt);
+
     fprintf(stderr, "%zu entries (%zu bytes) written\n",
             cnt, cnt * sizeof(binsquare_t));
     fprintf(stderr, "Note: This count excludes the null binsquare\n");
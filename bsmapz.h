@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * Compressed bsmap container ("bsmapz"), shared by the generators and the
+ * bsmap tools.
+ *
+ * The bit space is cut into containers of 2^16 bits in the manner of roaring
+ * bitmaps.  Only non-empty containers are stored, in ascending key order, each
+ * as a sorted array of 16-bit offsets while it holds at most
+ * BSMAPZ_ARRAY_MAX bits and as a plain 8 KiB bitmap otherwise.  The layout is
+ *
+ *   struct bsmapz_header
+ *   { struct bsmapz_record; uint16_t array[card] or uint64_t words[1024]; } ...
+ *   struct bsmapz_record with key BSMAPZ_KEY_END and card 0
+ *   uint64_t total number of bits set
+ *
+ * in host byte order.  It is written and read strictly sequentially, so it can
+ * go through pipes, and merging files never needs more than one container per
+ * input in memory.
+ */
+
+#ifndef BSMAPZ_H
+#define BSMAPZ_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#define BSMAPZ_MAGIC "BSMAPZ1\n"
+#define BSMAPZ_CONTAINER_SHIFT 16
+#define BSMAPZ_CONTAINER_WORDS ((1 << BSMAPZ_CONTAINER_SHIFT) / 64)
+#define BSMAPZ_ARRAY_MAX 4096
+#define BSMAPZ_KEY_END UINT32_MAX
+
+/* The map only holds the canonical member of every dihedral orbit. */
+#define BSMAPZ_FLAG_D4 1
+
+struct bsmapz_header {
+    char magic[8];
+    uint32_t order;
+    int32_t coeff_min, coeff_max;
+    uint32_t flags;
+};
+
+struct bsmapz_record {
+    uint32_t key;
+    uint32_t card;
+};
+
+struct bsmapz_container {
+    uint32_t key, card;
+    union {
+        uint16_t array[BSMAPZ_ARRAY_MAX];
+        uint64_t words[BSMAPZ_CONTAINER_WORDS];
+    };
+};
+
+static inline int bsmapz_is_array(const uint32_t card)
+{
+    return card <= BSMAPZ_ARRAY_MAX;
+}
+
+static inline void bsmapz_fwrite(const void *p, const size_t size, FILE *fp,
+        const char *path)
+{
+    if (fwrite(p, 1, size, fp) != size) {
+        fprintf(stderr, "fwrite: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void bsmapz_fread(void *p, const size_t size, FILE *fp,
+        const char *path)
+{
+    if (fread(p, 1, size, fp) != size) {
+        if (feof(fp))
+            fprintf(stderr, "error: %s: Truncated bsmapz\n", path);
+        else
+            fprintf(stderr, "fread: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void bsmapz_write_header(FILE *fp, const char *path,
+        const struct bsmapz_header *header)
+{
+    bsmapz_fwrite(header, sizeof(*header), fp, path);
+}
+
+static inline void bsmapz_header_init(struct bsmapz_header *header,
+        const int order, const int coeff_min, const int coeff_max,
+        const unsigned flags)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, BSMAPZ_MAGIC, sizeof(header->magic));
+    header->order = order;
+    header->coeff_min = coeff_min;
+    header->coeff_max = coeff_max;
+    header->flags = flags;
+}
+
+static inline int bsmapz_header_valid(const struct bsmapz_header *header)
+{
+    return !memcmp(header->magic, BSMAPZ_MAGIC, sizeof(header->magic));
+}
+
+/*
+ * Write the container key whose bits are words (BSMAPZ_CONTAINER_WORDS of
+ * them) in whichever form is smaller.  Return the number of bits written.
+ */
+static inline uint32_t bsmapz_write_words(FILE *fp, const char *path,
+        const uint32_t key, const uint64_t *words)
+{
+    struct bsmapz_record record;
+    uint16_t array[BSMAPZ_ARRAY_MAX];
+    uint32_t card = 0;
+    int i;
+
+    for (i = 0; i < BSMAPZ_CONTAINER_WORDS; i ++)
+        card += __builtin_popcountll(words[i]);
+    if (card == 0)
+        return 0;
+
+    record.key = key;
+    record.card = card;
+    bsmapz_fwrite(&record, sizeof(record), fp, path);
+
+    if (!bsmapz_is_array(card)) {
+        bsmapz_fwrite(words, BSMAPZ_CONTAINER_WORDS * sizeof(*words), fp, path);
+        return card;
+    }
+
+    card = 0;
+    for (i = 0; i < BSMAPZ_CONTAINER_WORDS; i ++) {
+        uint64_t u = words[i];
+        while (u) {
+            array[card ++] = (i << 6) | __builtin_ctzll(u);
+            u &= u - 1;
+        }
+    }
+    bsmapz_fwrite(array, card * sizeof(*array), fp, path);
+    return card;
+}
+
+static inline void bsmapz_write_end(FILE *fp, const char *path, const uint64_t count)
+{
+    const struct bsmapz_record record = {BSMAPZ_KEY_END, 0};
+    bsmapz_fwrite(&record, sizeof(record), fp, path);
+    bsmapz_fwrite(&count, sizeof(count), fp, path);
+}
+
+/*
+ * Write the whole dense map of 2^nbits_log2 bits to path.  Return the number of
+ * bits set.
+ */
+static inline uint64_t bsmapz_write_dense(const char *path,
+        const struct bsmapz_header *header, const uint64_t *map,
+        const int nbits_log2)
+{
+    const size_t ncontainers =
+        ((size_t) 1) << (nbits_log2 - BSMAPZ_CONTAINER_SHIFT);
+    uint64_t count = 0;
+    size_t key;
+    FILE *fp;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    bsmapz_write_header(fp, path, header);
+    for (key = 0; key < ncontainers; key ++)
+        count += bsmapz_write_words(fp, path, key,
+                map + key * BSMAPZ_CONTAINER_WORDS);
+    bsmapz_write_end(fp, path, count);
+
+    if (fclose(fp)) {
+        fprintf(stderr, "fclose: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+/*
+ * Read the next container into c.  Return 0 (with c->key set to
+ * BSMAPZ_KEY_END) after the last one, checking the stored total against the
+ * running one in *countp.
+ */
+static inline int bsmapz_read_container(FILE *fp, const char *path,
+        struct bsmapz_container *c, uint64_t *countp)
+{
+    struct bsmapz_record record;
+
+    bsmapz_fread(&record, sizeof(record), fp, path);
+    c->key = record.key;
+    c->card = record.card;
+
+    if (record.key == BSMAPZ_KEY_END) {
+        uint64_t count;
+        bsmapz_fread(&count, sizeof(count), fp, path);
+        if (count != *countp) {
+            fprintf(stderr, "error: %s: Count mismatch (%" PRIu64 " != %" PRIu64 ")\n",
+                    path, *countp, count);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    if (record.card == 0 || record.card > (1 << BSMAPZ_CONTAINER_SHIFT)) {
+        fprintf(stderr, "error: %s: Invalid container\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (bsmapz_is_array(record.card))
+        bsmapz_fread(c->array, record.card * sizeof(*c->array), fp, path);
+    else
+        bsmapz_fread(c->words, sizeof(c->words), fp, path);
+    *countp += record.card;
+    return 1;
+}
+
+/* OR container c into words. */
+static inline void bsmapz_or_into(uint64_t *words,
+        const struct bsmapz_container *c)
+{
+    uint32_t i;
+
+    if (bsmapz_is_array(c->card)) {
+        for (i = 0; i < c->card; i ++)
+            words[c->array[i] >> 6] |= ((uint64_t) 1) << (c->array[i] & 63);
+    } else {
+        for (i = 0; i < BSMAPZ_CONTAINER_WORDS; i ++)
+            words[i] |= c->words[i];
+    }
+}
+
+/* Open the bsmapz at path and read its header into *header. */
+static inline FILE* bsmapz_open(const char *path, struct bsmapz_header *header)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    bsmapz_fread(header, sizeof(*header), fp, path);
+    if (!bsmapz_header_valid(header)) {
+        fprintf(stderr, "error: %s: Not a bsmapz\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+/*
+ * OR the containers of fp, opened with bsmapz_open, into the dense map of
+ * 2^nbits_log2 bits and close it.  Return the number of bits in the file.
+ */
+static inline uint64_t bsmapz_read_dense(FILE *fp, const char *path,
+        uint64_t *map, const int nbits_log2)
+{
+    static struct bsmapz_container c;
+    uint64_t count = 0;
+
+    while (bsmapz_read_container(fp, path, &c, &count)) {
+        if (c.key >= (((uint64_t) 1) << nbits_log2) >> BSMAPZ_CONTAINER_SHIFT) {
+            fprintf(stderr, "error: %s: Container out of range\n", path);
+            exit(EXIT_FAILURE);
+        }
+        bsmapz_or_into(map + (size_t) c.key * BSMAPZ_CONTAINER_WORDS, &c);
+    }
+    if (fclose(fp)) {
+        fprintf(stderr, "fclose: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+#endif /* BSMAPZ_H */
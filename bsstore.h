@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * Out-of-core store of binsquares, for ORDER >= 7 where a dense bsmap
+ * (1 << ORDER*ORDER bits, 64 TiB at ORDER=7) is out of the question.
+ *
+ * Every thread appends its binsquares to its own buffer.  A full buffer is
+ * radix sorted and deduplicated in place; if that leaves it at least half
+ * empty it is kept, otherwise it is spilled to disk as a sorted run.  Runs
+ * are delta coded with LEB128 varints, so a run of dense patterns takes a
+ * couple of bytes per pattern.  bsstore_finish() spills what is left and
+ * merges the runs with a k-way heap merge, dropping duplicates, into a
+ * bslist: the sorted array of non-null 64-bit binsquares that
+ * bsmap_to_bslist writes for ORDER=6.  More than BSSTORE_FANIN runs are
+ * first merged in groups.
+ *
+ * The memory is bounded by the budget given to bsstore_init(): every thread
+ * gets budget / nthreads for its buffer and the scratch of the sort, and
+ * the merge reads through BSSTORE_FANIN buffers of BSSTORE_IOBUF bytes.
+ */
+
+#ifndef BSSTORE_H
+#define BSSTORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#ifndef BSSTORE_FANIN
+#define BSSTORE_FANIN 256
+#endif
+#define BSSTORE_IOBUF (((size_t) 1) << 16)
+#define BSSTORE_RADIX_BITS 11
+#define BSSTORE_MIN_CAP (((size_t) 1) << 12)
+
+struct bsstore_thread {
+    uint64_t *buf, *tmp; /* [cap] */
+    size_t len;
+} __attribute__((aligned(64)));
+
+struct bsstore {
+    char prefix[0x100]; /* Run n is "prefix.n" */
+    int key_bits;
+    size_t cap;         /* Keys per thread buffer */
+    int nthreads;
+    struct bsstore_thread *threads;
+    int nruns;          /* Runs written so far */
+    uint64_t nspilled;  /* Keys written to runs */
+};
+
+struct bsstore_reader {
+    FILE *fp;
+    char *iobuf;
+    uint64_t key;
+};
+
+/* Parse a byte count with an optional k, m or g suffix; return 0 if invalid. */
+static inline size_t bsstore_parse_size(const char *str)
+{
+    char *end;
+    size_t size = strtoull(str, &end, 0);
+
+    switch (*end) {
+        case 'g': case 'G':
+            size <<= 10;
+            /* Fall through. */
+        case 'm': case 'M':
+            size <<= 10;
+            /* Fall through. */
+        case 'k': case 'K':
+            size <<= 10;
+            end ++;
+            break;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+static void* bsstore_malloc(const size_t size)
+{
+    void *p = malloc(size);
+
+    if (p == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static FILE* bsstore_fopen(const char *path, const char *mode, char *iobuf)
+{
+    FILE *fp = fopen(path, mode);
+
+    if (fp == NULL) {
+        fprintf(stderr, "fopen: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (iobuf != NULL)
+        (void) setvbuf(fp, iobuf, _IOFBF, BSSTORE_IOBUF);
+    return fp;
+}
+
+static void bsstore_fclose(FILE *fp, const char *path)
+{
+    if (ferror(fp) || fclose(fp)) {
+        fprintf(stderr, "fclose: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Set up store for nthreads threads within budget bytes, spilling runs to
+ * "dir/name.pid.n".  Keys are below 1 << key_bits.
+ */
+static void bsstore_init(struct bsstore *store, const size_t budget,
+        const int nthreads, const char *dir, const char *name, const int key_bits)
+{
+    int i;
+
+    if (snprintf(store->prefix, sizeof(store->prefix), "%s/%s.%ld", dir, name,
+                (long) getpid()) >= (int) sizeof(store->prefix)) {
+        fprintf(stderr, "error: %s: Path too long\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    store->key_bits = key_bits;
+    store->cap = budget / nthreads / (2 * sizeof(uint64_t));
+    if (store->cap < BSSTORE_MIN_CAP)
+        store->cap = BSSTORE_MIN_CAP;
+    store->nthreads = nthreads;
+    store->threads = aligned_alloc(64, sizeof(*store->threads) * nthreads);
+    if (store->threads == NULL) {
+        fprintf(stderr, "aligned_alloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nthreads; i ++) {
+        store->threads[i].buf = bsstore_malloc(store->cap * sizeof(uint64_t));
+        store->threads[i].tmp = bsstore_malloc(store->cap * sizeof(uint64_t));
+        store->threads[i].len = 0;
+    }
+    store->nruns = 0;
+    store->nspilled = 0;
+    printf("bsstore: %d x %zu keys in memory, runs in %s.*\n", nthreads,
+            store->cap, store->prefix);
+}
+
+/* Sort the buffer of t with an LSD radix sort and drop the duplicates. */
+static void bsstore_sort_unique(const struct bsstore *store,
+        struct bsstore_thread *t)
+{
+    const size_t nbins = ((size_t) 1) << BSSTORE_RADIX_BITS;
+    size_t count[((size_t) 1) << BSSTORE_RADIX_BITS];
+    size_t i, j;
+    int shift;
+
+    for (shift = 0; shift < store->key_bits; shift += BSSTORE_RADIX_BITS) {
+        uint64_t *const src = t->buf, *const dst = t->tmp;
+        size_t sum = 0;
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < t->len; i ++)
+            count[(src[i] >> shift) & (nbins - 1)] ++;
+        for (j = 0; j < nbins; j ++) {
+            const size_t c = count[j];
+            count[j] = sum;
+            sum += c;
+        }
+        for (i = 0; i < t->len; i ++)
+            dst[count[(src[i] >> shift) & (nbins - 1)] ++] = src[i];
+        t->buf = dst;
+        t->tmp = src;
+    }
+
+    for (i = j = 0; i < t->len; i ++)
+        if (j == 0 || t->buf[i] != t->buf[j - 1])
+            t->buf[j ++] = t->buf[i];
+    t->len = j;
+}
+
+static inline void bsstore_put_varint(FILE *fp, uint64_t v)
+{
+    while (v >= 0x80) {
+        putc_unlocked((int) (v & 0x7f) | 0x80, fp);
+        v >>= 7;
+    }
+    putc_unlocked((int) v, fp);
+}
+
+/* Write the sorted and unique buffer of t as a new run and empty it. */
+static void bsstore_spill(struct bsstore *store, struct bsstore_thread *t)
+{
+    const int n = __atomic_fetch_add(&store->nruns, 1, __ATOMIC_RELAXED);
+    char path[0x120];
+    uint64_t prev = 0;
+    FILE *fp;
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s.%d", store->prefix, n);
+    fp = bsstore_fopen(path, "wb", NULL);
+    for (i = 0; i < t->len; i ++) {
+        bsstore_put_varint(fp, t->buf[i] - prev);
+        prev = t->buf[i];
+    }
+    bsstore_fclose(fp, path);
+    __atomic_fetch_add(&store->nspilled, t->len, __ATOMIC_RELAXED);
+    t->len = 0;
+}
+
+static void bsstore_compact(struct bsstore *store, struct bsstore_thread *t)
+{
+    bsstore_sort_unique(store, t);
+    if (t->len > store->cap / 2)
+        bsstore_spill(store, t);
+}
+
+/* Add key from thread tid. */
+static inline void bsstore_insert(struct bsstore *store, const int tid,
+        const uint64_t key)
+{
+    struct bsstore_thread *const t = &store->threads[tid];
+
+    t->buf[t->len ++] = key;
+    if (__builtin_expect(t->len == store->cap, 0))
+        bsstore_compact(store, t);
+}
+
+/* Read the next key of r into r->key; return 0 at the end of the run. */
+static int bsstore_reader_next(struct bsstore_reader *r)
+{
+    uint64_t delta = 0;
+    int shift = 0, c;
+
+    while ((c = getc_unlocked(r->fp)) != EOF) {
+        delta |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            r->key += delta;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static void bsstore_sift_down(const struct bsstore_reader *r, int *heap,
+        const int len, int i)
+{
+    for (;;) {
+        int m = i;
+        const int left = 2*i + 1, right = 2*i + 2;
+        if (left < len && r[heap[left]].key < r[heap[m]].key)
+            m = left;
+        if (right < len && r[heap[right]].key < r[heap[m]].key)
+            m = right;
+        if (m == i)
+            return;
+        const int tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+        i = m;
+    }
+}
+
+/*
+ * Merge the runs [first, first + n) into out, as a run if raw is zero and
+ * as a bslist without the null binsquare otherwise, and delete them.
+ * Return the number of keys written.
+ */
+static uint64_t bsstore_merge(const struct bsstore *store, const int first,
+        const int n, FILE *out, const int raw)
+{
+    struct bsstore_reader *r = bsstore_malloc(sizeof(*r) * n);
+    int *heap = bsstore_malloc(sizeof(*heap) * n);
+    char path[0x120];
+    uint64_t prev = 0, count = 0;
+    int i, len = 0;
+
+    for (i = 0; i < n; i ++) {
+        snprintf(path, sizeof(path), "%s.%d", store->prefix, first + i);
+        r[i].iobuf = bsstore_malloc(BSSTORE_IOBUF);
+        r[i].fp = bsstore_fopen(path, "rb", r[i].iobuf);
+        r[i].key = 0;
+        if (bsstore_reader_next(&r[i]))
+            heap[len ++] = i;
+    }
+    for (i = len / 2 - 1; i >= 0; i --)
+        bsstore_sift_down(r, heap, len, i);
+
+    while (len > 0) {
+        struct bsstore_reader *const top = &r[heap[0]];
+        /* Like bsmap_to_bslist, a bslist excludes the null binsquare. */
+        if ((count == 0 || top->key != prev) && !(raw && top->key == 0)) {
+            if (raw) {
+                int k;
+                for (k = 0; k < (int) sizeof(top->key); k ++)
+                    putc_unlocked((int) (top->key >> (k * 8)) & 0xff, out);
+            } else
+                bsstore_put_varint(out, top->key - prev);
+            prev = top->key;
+            count ++;
+        }
+        if (!bsstore_reader_next(top))
+            heap[0] = heap[-- len];
+        bsstore_sift_down(r, heap, len, 0);
+    }
+
+    for (i = 0; i < n; i ++) {
+        snprintf(path, sizeof(path), "%s.%d", store->prefix, first + i);
+        bsstore_fclose(r[i].fp, path);
+        free(r[i].iobuf);
+        if (unlink(path)) {
+            fprintf(stderr, "unlink: %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(heap);
+    free(r);
+    return count;
+}
+
+/*
+ * Spill what is left, merge all runs into the bslist path and free the
+ * buffers.  Return the number of distinct non-null binsquares.
+ */
+static uint64_t bsstore_finish(struct bsstore *store, const char *path)
+{
+    char run_path[0x120];
+    char *iobuf = bsstore_malloc(BSSTORE_IOBUF);
+    int first = 0, i;
+    uint64_t count;
+    FILE *fp;
+
+    for (i = 0; i < store->nthreads; i ++) {
+        struct bsstore_thread *const t = &store->threads[i];
+        bsstore_sort_unique(store, t);
+        if (t->len != 0)
+            bsstore_spill(store, t);
+        free(t->buf);
+        free(t->tmp);
+    }
+    free(store->threads);
+    printf("bsstore: %d runs, %" PRIu64 " keys spilled\n", store->nruns,
+            store->nspilled);
+
+    /* Each group merge adds one run, so this ends after fewer than nruns. */
+    while (store->nruns - first > BSSTORE_FANIN) {
+        snprintf(run_path, sizeof(run_path), "%s.%d", store->prefix, store->nruns);
+        fp = bsstore_fopen(run_path, "wb", iobuf);
+        (void) bsstore_merge(store, first, BSSTORE_FANIN, fp, 0);
+        bsstore_fclose(fp, run_path);
+        first += BSSTORE_FANIN;
+        store->nruns ++;
+    }
+
+    fp = bsstore_fopen(path, "wb", iobuf);
+    count = bsstore_merge(store, first, store->nruns - first, fp, 1);
+    bsstore_fclose(fp, path);
+    free(iobuf);
+    return count;
+}
+
+#endif /* BSSTORE_H */
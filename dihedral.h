@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * Dihedral symmetry reduction shared by the generators.
+ *
+ * The eight symmetries of the square permute the rows, the columns and the
+ * two diagonals among themselves, so the set of patterns is closed under them
+ * and it suffices to enumerate one coefficient tuple per orbit.  A tuple is
+ * skipped as soon as the known prefix of one of its images is
+ * lexicographically larger than its own prefix; the lexicographically largest
+ * tuple of every orbit is therefore always enumerated.  Choosing the largest
+ * one keeps the reduction compatible with the generators that only enumerate
+ * c0 >= 0 because of the sign symmetry (DIHEDRAL_NEGATE).
+ *
+ * The includer defines ORDER and binsquare_t.  Line ids follow
+ * square_addsub_line: rows are 0..ORDER-1, columns ORDER..2*ORDER-1, then the
+ * main diagonal and the anti-diagonal.  Cell (i, j) is bit ORDER*i+j of the
+ * binsquare or its mirror image ORDER*ORDER-1-(ORDER*i+j); the two layouts
+ * differ by the 180 degree rotation, which commutes with the whole group, so
+ * the same tables serve both.
+ */
+
+#ifndef DIHEDRAL_H
+#define DIHEDRAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef DIHEDRAL_NEGATE
+#define DIHEDRAL_NEGATE 0
+#endif /* DIHEDRAL_NEGATE */
+
+#define DIHEDRAL_NLINES (ORDER*2+2)
+
+/* dihedral_line_src[g][l]: line of the tuple that lands on line l under g. */
+static int dihedral_line_src[8][DIHEDRAL_NLINES];
+/* dihedral_row_image[g][i][bits]: image under g of row i holding bits. */
+static binsquare_t dihedral_row_image[8][ORDER][1 << ORDER];
+
+static void dihedral_cell(const int g, const int i, const int j,
+        int *ip, int *jp)
+{
+    const int n = ORDER - 1;
+    switch (g) {
+        default:
+        case 0: *ip = i;     *jp = j;     break;
+        case 1: *ip = i;     *jp = n - j; break;
+        case 2: *ip = n - i; *jp = j;     break;
+        case 3: *ip = n - i; *jp = n - j; break;
+        case 4: *ip = j;     *jp = i;     break;
+        case 5: *ip = j;     *jp = n - i; break;
+        case 6: *ip = n - j; *jp = i;     break;
+        case 7: *ip = n - j; *jp = n - i; break;
+    }
+}
+
+/* Image under g of the line through (i0, j0) and (i1, j1). */
+static int dihedral_line_of(const int g, const int i0, const int j0,
+        const int i1, const int j1)
+{
+    int a0, b0, a1, b1;
+    dihedral_cell(g, i0, j0, &a0, &b0);
+    dihedral_cell(g, i1, j1, &a1, &b1);
+    if (a0 == a1)
+        return a0;
+    if (b0 == b1)
+        return ORDER + b0;
+    if (a0 == b0)
+        return ORDER*2 + 0;
+    return ORDER*2 + 1;
+}
+
+static void dihedral_init(void)
+{
+    int g, l, i, j;
+    unsigned bits;
+
+    for (g = 0; g < 8; g ++) {
+        for (l = 0; l < ORDER; l ++) {
+            dihedral_line_src[g][dihedral_line_of(g, l, 0, l, 1)] = l;
+            dihedral_line_src[g][dihedral_line_of(g, 0, l, 1, l)] = ORDER + l;
+        }
+        dihedral_line_src[g][dihedral_line_of(g, 0, 0, 1, 1)] = ORDER*2 + 0;
+        dihedral_line_src[g][dihedral_line_of(g, 0, ORDER-1, 1, ORDER-2)] = ORDER*2 + 1;
+
+        for (i = 0; i < ORDER; i ++) {
+            for (bits = 0; bits < (1 << ORDER); bits ++) {
+                binsquare_t image = 0;
+                for (j = 0; j < ORDER; j ++) {
+                    int a, b;
+                    if (!(bits & (1 << j)))
+                        continue;
+                    dihedral_cell(g, i, j, &a, &b);
+                    image |= ((binsquare_t) 1) << (ORDER*a + b);
+                }
+                dihedral_row_image[g][i][bits] = image;
+            }
+        }
+    }
+}
+
+/*
+ * Return non-zero if the tuple whose first len coefficients are t can be
+ * skipped because an image of it is larger on a prefix known from t.
+ * Only len == ORDER (rows) and len == ORDER*2 (rows and columns) are useful:
+ * at the other lengths the images have unknown coefficients early on.
+ */
+static int dihedral_dominated(const int *t, const int len)
+{
+    int g, s, l;
+
+    for (g = 1; g < 8 * (DIHEDRAL_NEGATE ? 2 : 1); g ++) {
+        const int *src = dihedral_line_src[g % 8];
+        const int sign = (g < 8) ? 1 : -1;
+        for (l = 0; l < len; l ++) {
+            if (src[l] >= len)
+                break;
+            s = sign * t[src[l]];
+            if (s != t[l]) {
+                if (s > t[l])
+                    return 1;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static inline binsquare_t dihedral_image(const int g, const binsquare_t binsquare)
+{
+    const unsigned mask = (1 << ORDER) - 1;
+    binsquare_t image = 0;
+    int i;
+    for (i = 0; i < ORDER; i ++)
+        image |= dihedral_row_image[g][i][(binsquare >> (ORDER*i)) & mask];
+    return image;
+}
+
+/* The smallest binsquare of the orbit of binsquare. */
+static inline binsquare_t dihedral_canon(const binsquare_t binsquare)
+{
+    binsquare_t canon = binsquare;
+    int g;
+    for (g = 1; g < 8; g ++) {
+        const binsquare_t image = dihedral_image(g, binsquare);
+        if (image < canon)
+            canon = image;
+    }
+    return canon;
+}
+
+/*
+ * Rewrite map (one bit per binsquare) in place so that it holds either only
+ * the canonical representative of every orbit it touches or, if expand is
+ * non-zero, every member of those orbits.  Bits are updated atomically so
+ * that the words can be processed in parallel.
+ */
+static void dihedral_finalize(uint64_t *map, const int expand)
+{
+    const size_t nwords = (((size_t) 1) << (ORDER*ORDER)) / 64;
+    size_t w;
+
+#pragma omp parallel for schedule(dynamic, 4096)
+    for (w = 0; w < nwords; w ++) {
+        uint64_t u = __atomic_load_n(&map[w], __ATOMIC_RELAXED);
+        while (u) {
+            const binsquare_t binsquare = (w << 6) | __builtin_ctzll(u);
+            int g;
+            u &= u - 1;
+            if (expand) {
+                for (g = 1; g < 8; g ++) {
+                    const binsquare_t image = dihedral_image(g, binsquare);
+                    __atomic_fetch_or(&map[image >> 6],
+                            ((uint64_t) 1) << (image & 63), __ATOMIC_RELAXED);
+                }
+            } else {
+                const binsquare_t canon = dihedral_canon(binsquare);
+                if (canon == binsquare)
+                    continue;
+                __atomic_fetch_or(&map[canon >> 6],
+                        ((uint64_t) 1) << (canon & 63), __ATOMIC_RELAXED);
+                __atomic_fetch_and(&map[w],
+                        ~(((uint64_t) 1) << (binsquare & 63)), __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+#endif /* DIHEDRAL_H */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * One generator binary for every ORDER and ISA.  The ORDER=5 and ORDER=6
+ * generators are built once per ISA as kernels (see gen.h) and linked
+ * together with this dispatcher, which picks the widest kernel the CPU
+ * supports for the requested ORDER and passes the other options on to it:
+ *
+ *   F="-O3 -fopenmp"  # plus DIHEDRAL, GRAY, ... as for the standalone builds
+ *   cc $F -mavx512bw -mavx512vl -DGEN_KERNEL=gen_5_avx512bw -c main-5-avx512bw.c -o gen-5-avx512bw.o
+ *   cc $F -mavx2 -DGEN_KERNEL=gen_5_avx2 -c main-5-avx512bw.c -o gen-5-avx2.o
+ *   cc $F -mavx512bw -DGEN_KERNEL=gen_6_avx512bw -c main-6-avx512bw.c -o gen-6-avx512bw.o
+ *   cc $F -mavx2 -DGEN_KERNEL=gen_6_avx2 -c main-6-avx512bw.c -o gen-6-avx2.o
+ *   cc $F gen.c gen-*.o -lpthread -o gen
+ *
+ * gen.c itself must be built without ISA flags so that it runs everywhere.
+ * "gen --bench-all" runs --bench of every supported kernel over the ranges
+ * with reference checksums (see bench.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "gen.h"
+#include "bench.h"
+
+int gen_coeff_min, gen_coeff_max;
+
+struct gen_kernel {
+    int order;
+    const char *name;
+    int (*main)(int argc, char *argv[]);
+};
+
+/* Widest first for every ORDER. */
+static const struct gen_kernel gen_kernels[] = {
+    {5, "avx512bw", gen_5_avx512bw},
+    {5, "avx2", gen_5_avx2},
+    {6, "avx512bw", gen_6_avx512bw},
+    {6, "avx2", gen_6_avx2},
+};
+#define GEN_NKERNELS (sizeof(gen_kernels) / sizeof(gen_kernels[0]))
+
+static int gen_kernel_supported(const struct gen_kernel *k)
+{
+    __builtin_cpu_init();
+    /* __builtin_cpu_supports only takes string literals. */
+    if (!strcmp(k->name, "avx512bw"))
+        return __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vl");
+    if (!strcmp(k->name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s --order N --coeff-min MIN --coeff-max MAX [--isa ISA]\n"
+            "          [generator options]\n", argv0);
+    fprintf(stderr, "  --order N        Order of the square (5 or 6)\n");
+    fprintf(stderr, "  --coeff-min MIN  Smallest coefficient\n");
+    fprintf(stderr, "  --coeff-max MAX  Largest coefficient\n");
+    fprintf(stderr, "  --isa ISA        Use the ISA kernel instead of the widest supported one\n");
+    fprintf(stderr, "The other options are those of the ORDER=N generator.\n");
+    fprintf(stderr, "Usage: %s --bench-all [--order N]\n", argv0);
+    fprintf(stderr, "  --bench-all      Run --bench of every supported kernel over every range\n"
+            "                   with a reference checksum\n");
+}
+
+/*
+ * Run every supported kernel with --bench over the ranges of bench_goldens,
+ * each in a child process since the kernels keep their maps and options in
+ * globals.  Return the number of failed runs.
+ */
+static int bench_all(const char *argv0, const int order)
+{
+    int nfailed = 0, nruns = 0;
+    size_t i, k;
+
+    for (i = 0; i < BENCH_NGOLDENS; i ++) {
+        const struct bench_golden *g = &bench_goldens[i];
+        if (order != 0 && g->order != order)
+            continue;
+        for (k = 0; k < GEN_NKERNELS; k ++) {
+            const struct gen_kernel *p = &gen_kernels[k];
+            char *kargv[] = {(char*) argv0, "--bench", NULL};
+            pid_t pid;
+            int status;
+
+            if (p->order != g->order || !gen_kernel_supported(p))
+                continue;
+            printf("Kernel: ORDER=%d %s COEFF_{MIN,MAX} = {%d, %d}\n",
+                    p->order, p->name, g->coeff_min, g->coeff_max);
+            fflush(stdout);
+            pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+            }
+            if (pid == 0) {
+                gen_coeff_min = g->coeff_min;
+                gen_coeff_max = g->coeff_max;
+                exit(p->main(2, kargv));
+            }
+            if (waitpid(pid, &status, 0) == -1) {
+                perror("waitpid");
+                exit(EXIT_FAILURE);
+            }
+            nruns ++;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("FAILED: ORDER=%d %s COEFF_{MIN,MAX} = {%d, %d}\n",
+                        p->order, p->name, g->coeff_min, g->coeff_max);
+                nfailed ++;
+            }
+        }
+    }
+    printf("bench-all: %d of %d runs failed\n", nfailed, nruns);
+    return nfailed;
+}
+
+/*
+ * If argv[*i] is the option name, either as "name VALUE" or as "name=VALUE",
+ * return its value and advance *i past it.
+ */
+static const char* gen_optarg(const int argc, char *argv[], int *i,
+        const char *name)
+{
+    const size_t len = strlen(name);
+
+    if (strncmp(argv[*i], name, len))
+        return NULL;
+    if (argv[*i][len] == '=')
+        return argv[*i] + len + 1;
+    if (argv[*i][len] != '\0')
+        return NULL;
+    if (*i + 1 >= argc) {
+        fprintf(stderr, "error: %s requires an argument\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return argv[++ *i];
+}
+
+int main(int argc, char *argv[])
+{
+    const char *isa = NULL, *val;
+    const struct gen_kernel *kernel = NULL;
+    int order = 0, have_min = 0, have_max = 0, do_bench_all = 0;
+    int kargc = 1, i;
+    char **kargv;
+    size_t k;
+
+    /* Take our options out and leave the rest to the kernel. */
+    kargv = calloc(argc + 1, sizeof(*kargv));
+    if (kargv == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    kargv[0] = argv[0];
+    for (i = 1; i < argc; i ++) {
+        if ((val = gen_optarg(argc, argv, &i, "--order")) != NULL)
+            order = atoi(val);
+        else if ((val = gen_optarg(argc, argv, &i, "--coeff-min")) != NULL) {
+            gen_coeff_min = atoi(val);
+            have_min = 1;
+        } else if ((val = gen_optarg(argc, argv, &i, "--coeff-max")) != NULL) {
+            gen_coeff_max = atoi(val);
+            have_max = 1;
+        } else if ((val = gen_optarg(argc, argv, &i, "--isa")) != NULL)
+            isa = val;
+        else if (!strcmp(argv[i], "--bench-all"))
+            do_bench_all = 1;
+        else if (!strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else
+            kargv[kargc ++] = argv[i];
+    }
+
+    if (do_bench_all) {
+        if (kargc != 1 || (order != 0 && order != 5 && order != 6)) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return bench_all(argv[0], order) ? EXIT_FAILURE : 0;
+    }
+    if (!have_min || !have_max || (order != 5 && order != 6)) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (gen_coeff_min > gen_coeff_max) {
+        fprintf(stderr, "error: COEFF_MIN must be smaller or equal to COEFF_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+    /* The cells are int8_t: every sum of 2*ORDER+2 coefficients must fit. */
+    if (abs(gen_coeff_min) * (2*order + 2) > 127
+            || abs(gen_coeff_max) * (2*order + 2) > 127) {
+        fprintf(stderr, "error: Coefficients out of range for ORDER=%d\n", order);
+        exit(EXIT_FAILURE);
+    }
+
+    for (k = 0; k < GEN_NKERNELS; k ++) {
+        const struct gen_kernel *p = &gen_kernels[k];
+        if (p->order != order || (isa != NULL && strcmp(p->name, isa)))
+            continue;
+        if (!gen_kernel_supported(p)) {
+            if (isa != NULL) {
+                fprintf(stderr, "error: This CPU does not support %s\n", isa);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        kernel = p;
+        break;
+    }
+    if (kernel == NULL) {
+        if (isa != NULL)
+            fprintf(stderr, "error: No %s kernel for ORDER=%d\n", isa, order);
+        else
+            fprintf(stderr, "error: This CPU supports no kernel for ORDER=%d\n",
+                    order);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Kernel: ORDER=%d %s\n", kernel->order, kernel->name);
+    return kernel->main(kargc, kargv);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * Kernels of the single generator binary (see gen.c).  A generator source
+ * built with -DGEN_KERNEL=name has its main renamed to name and reads the
+ * coefficient range from gen_coeff_min and gen_coeff_max instead of the
+ * COEFF_MIN and COEFF_MAX macros.
+ */
+
+#ifndef GEN_H
+#define GEN_H
+
+extern int gen_coeff_min, gen_coeff_max;
+
+int gen_5_avx512bw(int argc, char *argv[]);
+int gen_5_avx2(int argc, char *argv[]);
+int gen_6_avx512bw(int argc, char *argv[]);
+int gen_6_avx2(int argc, char *argv[]);
+
+/*
+ * Run the statements with the constant gen_radix equal to radix.  The
+ * innermost coefficient loop is only unrolled if its trip count is known at
+ * compile time, so it gets a copy for each of the common radices.
+ */
+#define GEN_RADIX_CASE(r, ...) \
+    case r: { const int gen_radix = r; __VA_ARGS__ } break;
+#define GEN_RADIX_SWITCH(radix, ...) \
+    switch (radix) { \
+        GEN_RADIX_CASE(2, __VA_ARGS__) \
+        GEN_RADIX_CASE(3, __VA_ARGS__) \
+        GEN_RADIX_CASE(4, __VA_ARGS__) \
+        GEN_RADIX_CASE(5, __VA_ARGS__) \
+        GEN_RADIX_CASE(6, __VA_ARGS__) \
+        GEN_RADIX_CASE(7, __VA_ARGS__) \
+        GEN_RADIX_CASE(8, __VA_ARGS__) \
+        default: { const int gen_radix = (radix); __VA_ARGS__ } break; \
+    }
+
+#endif /* GEN_H */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * Loopless reflected mixed-radix Gray code over coefficient tuples (Knuth,
+ * TAOCP 7.2.1.1, Algorithm H).  Every digit runs over
+ * [COEFF_MIN, COEFF_MAX] and starts at COEFF_MIN; each step moves exactly one
+ * digit by +1 or -1, so the square is updated with a single line vector add
+ * and never has to be saved or restored.  Digit 0 changes fastest.
+ */
+
+#ifndef GRAY_H
+#define GRAY_H
+
+#define GRAY_RADIX (COEFF_MAX - COEFF_MIN + 1)
+#define GRAY_DIGITS_MAX 14
+
+/* The kernels of gen only know the range at run time and check it there. */
+#if !defined(GEN_KERNEL) && GRAY_RADIX < 2
+#error "GRAY requires COEFF_MIN < COEFF_MAX"
+#endif
+
+struct gray {
+    int n;
+    int a[GRAY_DIGITS_MAX];     /* Digit value minus COEFF_MIN. */
+    int o[GRAY_DIGITS_MAX];     /* Direction: +1 or -1. */
+    int f[GRAY_DIGITS_MAX + 1]; /* Focus pointers. */
+};
+
+static inline void gray_init(struct gray *gray, const int n)
+{
+    int j;
+    gray->n = n;
+    for (j = 0; j < n; j ++) {
+        gray->a[j] = 0;
+        gray->o[j] = 1;
+        gray->f[j] = j;
+    }
+    gray->f[n] = n;
+}
+
+/*
+ * Advance to the next tuple.  Return the digit that moved and store the
+ * direction it moved in to *dir, or return -1 after the last tuple.
+ */
+static inline int gray_next(struct gray *gray, int *dir)
+{
+    const int j = gray->f[0];
+
+    gray->f[0] = 0;
+    if (unlikely(j == gray->n))
+        return -1;
+
+    *dir = gray->o[j];
+    gray->a[j] += gray->o[j];
+    if (gray->a[j] == 0 || gray->a[j] == GRAY_RADIX - 1) {
+        gray->o[j] = -gray->o[j];
+        gray->f[j] = gray->f[j + 1];
+        gray->f[j + 1] = j + 1;
+    }
+    return j;
+}
+
+#endif /* GRAY_H */
@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <immintrin.h>
 #include <omp.h>
@@ -28,6 +29,14 @@
 #endif
 #define ORDER 5
 
+#if defined(GEN_KERNEL)
+/* The coefficient range is given to gen on the command line. */
+#include "gen.h"
+#define COEFF_MIN gen_coeff_min
+#define COEFF_MAX gen_coeff_max
+#else
+#define GEN_RADIX_SWITCH(radix, ...) { const int gen_radix = (radix); __VA_ARGS__ }
+
 #if !defined(COEFF_MIN) || !defined(COEFF_MAX)
 #error "Define COEFF_MIN and COEFF_MAX"
 #endif
@@ -36,10 +45,61 @@
 #error "COEFF_MIN must be smaller or equal to COEFF_MAX"
 #endif
 
+#endif /* GEN_KERNEL */
+
 #ifndef PREFIX
 #define PREFIX ""
 #endif /* PREFIX */
 
+/*
+ * DIHEDRAL: enumerate one coefficient tuple per orbit of the symmetries of
+ * the square and write the canonical representatives only ("bsmap.*.d4").
+ * DIHEDRAL_EXPAND: same enumeration, but expand the orbits back to the full
+ * bsmap before writing it.
+ */
+#if defined(DIHEDRAL_EXPAND) && !defined(DIHEDRAL)
+#define DIHEDRAL
+#endif
+
+#if defined(DIHEDRAL) && !defined(DIHEDRAL_EXPAND)
+#define BSMAP_SUFFIX ".d4"
+#define BSMAPZ_FLAGS BSMAPZ_FLAG_D4
+#else
+#define BSMAP_SUFFIX ""
+#define BSMAPZ_FLAGS 0
+#endif
+
+/*
+ * GRAY: walk the coefficient tuples in reflected Gray order instead of the
+ * STA/END nest, so that every tuple costs exactly one line add.
+ */
+#if defined(GRAY) && defined(DIHEDRAL)
+#error "GRAY and DIHEDRAL cannot be combined"
+#endif
+
+/*
+ * LINEAR_DEP: the rows and the columns both add up to the all-ones square, so
+ * adding 1 to every row coefficient and subtracting 1 from every column one
+ * gives the same square.  Only enumerate the tuple of every such chain that
+ * cannot be moved down the chain without leaving the enumerated box (where
+ * c0 >= 0), and report how many tuples were skipped.
+ */
+#if defined(LINEAR_DEP) && (defined(DIHEDRAL) || defined(GRAY))
+#error "LINEAR_DEP cannot be combined with DIHEDRAL or GRAY"
+#endif
+
+/*
+ * MULTI_RANGE: also write the bsmaps of the nested ranges
+ * [max(COEFF_MIN, -k), min(COEFF_MAX, k)] for k = 1, ..., MR_LEVELS in the
+ * same pass.  A tuple is only inserted into the map of its level, the
+ * smallest k with max |c| <= k, and the map of every level is ORed into the
+ * next one at the end.  LINEAR_DEP may skip a tuple in favour of one on
+ * another level and GRAY does not keep the coefficients.
+ */
+#if defined(MULTI_RANGE) && (defined(LINEAR_DEP) || defined(GRAY))
+#error "MULTI_RANGE cannot be combined with LINEAR_DEP or GRAY"
+#endif
+
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -47,7 +107,63 @@ typedef int_fast8_t square_elem_t;
 typedef __m256i square_t;
 typedef uint32_t binsquare_t;
 
+/*
+ * The cells of square that are non-zero.  Without AVX-512BW/VL (e.g. for
+ * the AVX2 kernel of gen) the byte compare goes through movemask instead.
+ */
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+#define square_nonzero(square) \
+    ((binsquare_t) _cvtmask32_u32(_mm256_cmpneq_epi8_mask(square, _mm256_setzero_si256())))
+#else
+#define square_nonzero(square) \
+    ((binsquare_t) ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(square, _mm256_setzero_si256())))
+#endif
+
+#if defined(DIHEDRAL)
+/* c0 only runs over non-negative values: t and -t give the same pattern. */
+#define DIHEDRAL_NEGATE 1
+#include "dihedral.h"
+#endif
+
+#if defined(GRAY)
+#include "gray.h"
+#endif
+
+/*
+ * The bsmap is written in the compressed bsmapz format (see bsmapz.h) unless
+ * BSMAP_DENSE is defined, in which case the raw bitmap is dumped as before.
+ * --extend-from always reads a bsmapz.
+ */
+#include "bsmapz.h"
+
+#include "bench.h"
+#include "bsmap_alloc.h"
+
 #define BINSQUARE_MAP_SIZE (((size_t) 1) << (ORDER*ORDER - 3))
+#define BINSQUARE_MAP_WORDS (BINSQUARE_MAP_SIZE / sizeof(uint64_t))
+
+#if defined(MULTI_RANGE)
+#define MR_LEVELS (-COEFF_MIN > COEFF_MAX ? -COEFF_MIN : COEFF_MAX)
+#define MR_MIN(k) (COEFF_MIN > -(k) ? COEFF_MIN : -(k))
+#define MR_MAX(k) (COEFF_MAX < (k) ? COEFF_MAX : (k))
+/* Level of a tuple with c whose other coefficients are at level l. */
+#define MR_LEVEL(l, c) ((l) > abs(c) ? (l) : abs(c))
+
+/* Level of the coefficients t[0], ..., t[len-1]. */
+static inline int mr_level(const int *t, const int len)
+{
+    int l, level = 1;
+
+    for (l = 0; l < len; l ++)
+        level = MR_LEVEL(level, t[l]);
+    return level;
+}
+#else
+#define MR_LEVELS 1
+/* The only level is the whole range; k is still evaluated so it counts as used. */
+#define MR_MIN(k) ((void) (k), COEFF_MIN)
+#define MR_MAX(k) ((void) (k), COEFF_MAX)
+#endif
 
 static void print_square(square_t square)
 {
@@ -108,25 +224,25 @@ static void print_square(square_t square)
     square = _mm256_add_epi8(square, get_add(line_id, c))
 
 
-static void* my_cvalloc(const size_t size)
-{
-    intptr_t p;
-    const size_t align = 65536;
-    const size_t size_suf = size + align - 1;
-    p = (intptr_t) calloc(size_suf, 1);
-    if (p == (intptr_t) NULL)
-        return NULL;
-    const size_t mod = ((intptr_t) p) % align;
-    if (mod)
-        p += align - mod;
-    return (void*) p;
-}
+/* Page size to back the bsmap with, see bsmap_alloc.h. */
+static enum bsmap_pages bsmap_pages = BSMAP_PAGES_THP;
 
+/*
+ * Batch size of the probe stage, 0 to probe every binsquare at once.  An
+ * ORDER=5 map is only 4 MiB and mostly stays in cache, so batching is off by
+ * default.
+ */
+#define PROBE_BATCH_MAX 256
+static unsigned probe_batch = 0;
+
+/* The maps of all the MR_LEVELS levels, one after another. */
 static void* binsquare_init(void)
 {
+     const size_t size = BINSQUARE_MAP_SIZE * MR_LEVELS;
      void *map;
+     enum bsmap_pages got;
 
-     printf("Mapping %zu bytes\n", BINSQUARE_MAP_SIZE);
+     printf("Mapping %zu bytes\n", size);
 
      /*
       * order size
@@ -138,11 +254,12 @@ static void* binsquare_init(void)
 
 #if ORDER <= 5
 #warning "Using in-memory index"
-     map = my_cvalloc(BINSQUARE_MAP_SIZE);
+     map = bsmap_alloc(size, bsmap_pages, &got);
      if (map == NULL) {
-         fprintf(stderr, "my_cvalloc: %s\n", strerror(errno));
+         fprintf(stderr, "bsmap_alloc: %s\n", strerror(errno));
          exit(EXIT_FAILURE);
      }
+     printf("Mapped %zu bytes (pages: %s)\n", size, bsmap_pages_names[got]);
 #else
 #warning "Using out-of-memory index"
      int fd;
@@ -182,16 +299,49 @@ static void* binsquare_init(void)
      return map;
 }
 
-static void binsquare_finalize(void *map)
+/*
+ * The outer (c0, c1, c2) iterations are numbered in loop order, c2 running
+ * fastest.  A run covers the range [outer_begin, outer_end), which is a
+ * deterministic slice of them with --shard.
+ */
+#define OUTER_RADIX (COEFF_MAX - COEFF_MIN + 1)
+#define OUTER_LEN ((size_t) (COEFF_MAX + 1) * OUTER_RADIX * OUTER_RADIX)
+
+static size_t outer_begin, outer_end;
+
+static unsigned bsmap_shard, bsmap_nshards;
+
+/*
+ * Output path of the map of level k without the thread id:
+ * "bsmap.ORDER.MIN.MAX[.d4][.shardIofN]".
+ */
+static void bsmap_path(char *path, const size_t size, const int k)
+{
+    int len = snprintf(path, size, "bsmap.%d.%d.%d" BSMAP_SUFFIX,
+            ORDER, MR_MIN(k), MR_MAX(k));
+    if (bsmap_nshards != 0)
+        (void) snprintf(path + len, size - len, ".shard%uof%u",
+                bsmap_shard, bsmap_nshards);
+}
+
+static void binsquare_finalize(void *map, const int k)
 {
+    const int tid = omp_get_thread_num();
+    char path[0x100], str[0x120];
+#if !defined(BSMAP_DENSE)
+    struct bsmapz_header header;
+#else
     FILE *fp;
     size_t rets;
-    const int tid = omp_get_thread_num();
-    char str[0x100];
+#endif
 
-    snprintf(str, sizeof(str), "bsmap.%d.%d.%d.%d",
-            ORDER, COEFF_MIN, COEFF_MAX, tid);
+    bsmap_path(path, sizeof(path), k);
+    snprintf(str, sizeof(str), "%s.%d", path, tid);
 
+#if !defined(BSMAP_DENSE)
+    bsmapz_header_init(&header, ORDER, MR_MIN(k), MR_MAX(k), BSMAPZ_FLAGS);
+    (void) bsmapz_write_dense(str, &header, map, ORDER*ORDER);
+#else
     fp = fopen(str, "wb");
     if (fp == NULL) {
         fprintf(stderr, "fopen: %s: %s\n", str, strerror(errno));
@@ -208,13 +358,163 @@ static void binsquare_finalize(void *map)
         fprintf(stderr, "fclose: %s: %s\n", str, strerror(errno));
         exit(EXIT_FAILURE);
     }
+#endif
 }
 
-int main(void)
+/*
+ * --extend-from: the map starts out as an existing bsmap of the range
+ * [ext_min, ext_max] and only the tuples with at least one coefficient
+ * outside of it are enumerated.  The innermost loop of a tuple whose other
+ * coefficients are all inside skips the inside values, so the work is
+ * proportional to the new shell.  The range is empty without --extend-from.
+ *
+ * Whether the coefficients of the enclosing loops are all inside is kept as
+ * the count ext_out of those outside, updated by STA/END as the loops step
+ * and only with --extend-from (ext_on), so the innermost loop only tests it.
+ */
+static int ext_min = 1, ext_max = 0;
+static FILE *ext_fp = NULL;
+static const char *ext_path = "";
+#define EXT_IN(c) ((c) >= ext_min && (c) <= ext_max)
+
+/* Open path and take its range as the one to extend from. */
+static void extend_open(const char *path)
 {
+    struct bsmapz_header header;
+
+    ext_fp = bsmapz_open(path, &header);
+    if (header.order != ORDER || (header.flags & BSMAPZ_FLAG_D4)
+            || header.coeff_min > header.coeff_max
+            || header.coeff_min < COEFF_MIN || header.coeff_max > COEFF_MAX) {
+        fprintf(stderr, "error: %s: Not a full ORDER=%d bsmap of a range within "
+                "{%d, %d}\n", path, ORDER, COEFF_MIN, COEFF_MAX);
+        exit(EXIT_FAILURE);
+    }
+    ext_path = path;
+    ext_min = header.coeff_min;
+    ext_max = header.coeff_max;
+}
+
+/* OR the bsmap opened by extend_open into map. */
+static void extend_read(uint64_t *map)
+{
+    const uint64_t count = bsmapz_read_dense(ext_fp, ext_path, map, ORDER*ORDER);
+    printf("Extending %s: COEFF_{MIN,MAX} = {%d, %d}, %" PRIu64 " patterns\n",
+            ext_path, ext_min, ext_max, count);
+    ext_fp = NULL;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--bench] [--hugepages 1g|2m|thp|none] [--probe-batch N]\n"
+            "          [--extend-from BSMAP] [--shard I/N]\n", argv0);
+    fprintf(stderr, "  --bench           Time the enumeration and check the bsmap instead of writing it\n");
+    fprintf(stderr, "  --hugepages SIZE  Page size of the bsmap (default: thp)\n");
+    fprintf(stderr, "  --probe-batch N   Prefetch and probe the bsmap in batches of N (0: off and the default, max %d)\n",
+            PROBE_BATCH_MAX);
+    fprintf(stderr, "  --extend-from BSMAP  Start from the bsmapz BSMAP of a narrower range and only\n"
+            "                    enumerate the tuples outside of it\n");
+    fprintf(stderr, "  --shard I/N       Only cover the I-th of N slices of the outer loops\n");
+}
+
+#if defined(GEN_KERNEL)
+int GEN_KERNEL(int argc, char *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+    static const struct option longopts[] = {
+        {"bench",     no_argument, NULL, 'B'},
+        {"hugepages", required_argument, NULL, 'H'},
+        {"probe-batch", required_argument, NULL, 'q'},
+        {"extend-from", required_argument, NULL, 'e'},
+        {"shard",     required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    unsigned shard = 0, nshards = 0;
+    int do_bench = 0;
+    const char *extend_path = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'B':
+                do_bench = 1;
+                break;
+            case 'H':
+                if (bsmap_pages_parse(optarg, &bsmap_pages)) {
+                    fprintf(stderr, "error: Invalid page size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                probe_batch = strtoul(optarg, NULL, 0);
+                if (probe_batch > PROBE_BATCH_MAX) {
+                    fprintf(stderr, "error: Invalid probe batch: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                extend_path = optarg;
+                break;
+            case 'S':
+                if (sscanf(optarg, "%u/%u", &shard, &nshards) != 2
+                        || nshards == 0 || shard >= nshards) {
+                    fprintf(stderr, "error: Invalid shard: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
     printf("Built on %s %s\n", __DATE__, __TIME__);
     printf("ORDER = %d\n", ORDER);
     printf("COEFF_{MIN,MAX} = {%d, %d}\n", COEFF_MIN, COEFF_MAX);
+#if defined(GRAY) && defined(GEN_KERNEL)
+    if (GRAY_RADIX < 2) {
+        fprintf(stderr, "error: GRAY requires COEFF_MIN < COEFF_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+#if defined(MULTI_RANGE)
+    if (COEFF_MIN > 0 || COEFF_MAX < 0 || COEFF_MIN == COEFF_MAX) {
+        fprintf(stderr, "error: MULTI_RANGE requires COEFF_MIN <= 0 <= COEFF_MAX and COEFF_MIN < COEFF_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+    /* A batch would be flushed into the map of the level of its last tuple. */
+    if (probe_batch != 0 || extend_path != NULL) {
+        fprintf(stderr, "error: --probe-batch and --extend-from are not supported with MULTI_RANGE\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("MULTI_RANGE: %d levels\n", MR_LEVELS);
+#endif
+
+    bsmap_shard = shard;
+    bsmap_nshards = nshards;
+    outer_begin = 0;
+    outer_end = OUTER_LEN;
+    if (nshards != 0) {
+        outer_begin = OUTER_LEN * shard / nshards;
+        outer_end = OUTER_LEN * (shard + 1) / nshards;
+        printf("Shard %u/%u: outer iterations [%zu, %zu) of %zu\n",
+                shard, nshards, outer_begin, outer_end, (size_t) OUTER_LEN);
+    }
+
+#if defined(DIHEDRAL)
+    dihedral_init();
+#endif
+
+    if (extend_path != NULL) {
+#if defined(GRAY)
+        fprintf(stderr, "error: --extend-from is not supported with GRAY\n");
+        exit(EXIT_FAILURE);
+#endif
+        extend_open(extend_path);
+    }
 
 #define PUSH(n) square_orig_c##n = square
 
@@ -224,15 +524,75 @@ int main(void)
 
 #define POP(n) square = square_orig_c##n
 
-#define STA(n) PUSH(n); ADD(n, COEFF_MIN); LOOP(n) {
-#define END(n) ADD(n, 1); } POP(n)
+#define EXT_STEP(n, op) do { if (ext_on) ext_out op !EXT_IN(c##n); } while (0)
+
+#define STA(n) PUSH(n); ADD(n, COEFF_MIN); LOOP(n) { EXT_STEP(n, +=);
+#define END(n) EXT_STEP(n, -=); ADD(n, 1); } POP(n)
+
+#define PROBE(binsquare) \
+    do { \
+        const size_t off = (binsquare) >> 6; \
+        const uint64_t hot = ((uint64_t) 1) << ((binsquare) & ((binsquare_t) (64-1))); \
+        if (!(map[off] & hot)) \
+            map[off] |= hot; \
+    } while (0)
 
-#pragma omp parallel
+/*
+ * With probe_batch, INSERT only prefetches the map word of binsquare and
+ * stages it; the whole batch is probed once it is full, so that up to
+ * probe_batch misses are in flight instead of one.
+ */
+#define INSERT(binsquare) \
+    do { \
+        if (probe_batch != 0) { \
+            __builtin_prefetch(&map[(binsquare) >> 6]); \
+            probe_buf[probe_len ++] = (binsquare); \
+            if (probe_len == probe_batch) \
+                PROBE_FLUSH(); \
+        } else \
+            PROBE(binsquare); \
+    } while (0)
+
+#define PROBE_FLUSH() \
+    do { \
+        unsigned i_; \
+        for (i_ = 0; i_ < probe_len; i_ ++) \
+            PROBE(probe_buf[i_]); \
+        probe_len = 0; \
+    } while (0)
+
+    uint64_t insert_count = 0;
+#if defined(LINEAR_DEP)
+    uint64_t skipped_count = 0;
+#endif
+    uint64_t *bench_map = NULL;
+    double time;
+
+    if (do_bench)
+        bench_tlb_start();
+    time = omp_get_wtime();
+#if defined(LINEAR_DEP)
+#pragma omp parallel reduction(+:skipped_count, insert_count)
+#else
+#pragma omp parallel reduction(+:insert_count)
+#endif
     {
         square_t square;
         uint64_t *map = binsquare_init();
+#if defined(MULTI_RANGE)
+        uint64_t *const maps = map;
+#endif
+        size_t outer;
         int c0, c1, c2;
+        binsquare_t probe_buf[PROBE_BATCH_MAX];
+        unsigned probe_len = 0;
+
+        /* The per-thread maps are ORed together, so one of them suffices. */
+        if (ext_fp != NULL && omp_get_thread_num() == 0)
+            extend_read(map);
 
+/* The Gray walk keeps no per-level coefficients or squares. */
+#if !defined(GRAY)
 #define X(n) int c##n; square_t square_orig_c##n;
             X(3)
             X(4)
@@ -244,78 +604,262 @@ int main(void)
             X(10)
             X(11)
 #undef X
+        const int ext_on = ext_min <= ext_max;
+        int ext_out;
+#endif
 
-#pragma omp for nowait collapse(3)
-        for (c0 = 0; c0 <= COEFF_MAX; c0 ++) {
-            for (c1 = COEFF_MIN; c1 <= COEFF_MAX; c1 ++) {
-                for (c2 = COEFF_MIN; c2 <= COEFF_MAX; c2 ++) {
-                    square = _mm256_setzero_si256();
-                    ADD(0, c0);
-                    ADD(1, c1);
-                    ADD(2, c2);
-                    STA(3);
-                        STA(4);
-                            STA(5);
-                                STA(6);
-                                    STA(7);
-                                        STA(8);
-                                            STA(9);
-                                                STA(10);
+#if defined(GRAY)
+        square_t gray_step[2][ORDER*2+2];
+        {
+            int l;
+            for (l = 0; l < ORDER*2+2; l ++) {
+                gray_step[0][l] = get_add(l, -1);
+                gray_step[1][l] = get_add(l, 1);
+            }
+        }
+#endif
+
+#pragma omp for nowait
+        for (outer = outer_begin; outer < outer_end; outer ++) {
+            c2 = COEFF_MIN + outer % OUTER_RADIX;
+            c1 = COEFF_MIN + outer / OUTER_RADIX % OUTER_RADIX;
+            c0 = outer / OUTER_RADIX / OUTER_RADIX;
+
+            square = _mm256_setzero_si256();
+            ADD(0, c0);
+            ADD(1, c1);
+            ADD(2, c2);
+#if defined(GRAY)
+            {
+                struct gray gray;
+                int j, k, dir;
+                square_t step0 = gray_step[1][ORDER*2+1];
+
+                for (j = 3; j < ORDER*2+2; j ++)
+                    ADD(j, COEFF_MIN);
+                /* Digit 0 (the last line) sweeps back and forth in a plain loop. */
+                gray_init(&gray, ORDER*2+2 - 3 - 1);
+                for (;;) {
+                    for (k = 0; ; k ++) {
+                        const binsquare_t binsquare = square_nonzero(square);
+                        INSERT(binsquare);
+                        if (k == GRAY_RADIX - 1)
+                            break;
+                        square = _mm256_add_epi8(square, step0);
+                    }
+                    insert_count += GRAY_RADIX;
+                    step0 = _mm256_sub_epi8(_mm256_setzero_si256(), step0);
+                    if ((j = gray_next(&gray, &dir)) < 0)
+                        break;
+                    square = _mm256_add_epi8(square, gray_step[dir > 0][ORDER*2 - j]);
+                }
+            }
+#else
+            ext_out = ext_on ? !EXT_IN(c0) + !EXT_IN(c1) + !EXT_IN(c2) : 1;
+            STA(3);
+                STA(4);
+#if defined(DIHEDRAL)
+                const int t_rows[ORDER] = {c0, c1, c2, c3, c4};
+                if (!dihedral_dominated(t_rows, ORDER)) {
+#endif
+                    STA(5);
+                        STA(6);
+                            STA(7);
+                                STA(8);
+                                    STA(9);
+#if defined(MULTI_RANGE)
+                                    const int t_level[ORDER*2] = {c0, c1, c2, c3, c4, c5, c6, c7, c8, c9};
+                                    const int level9 = mr_level(t_level, ORDER*2);
+#endif
+#if defined(DIHEDRAL)
+                                    const int t[ORDER*2] = {c0, c1, c2, c3, c4, c5, c6, c7, c8, c9};
+                                    if (!dihedral_dominated(t, ORDER*2)) {
+#endif
+#if defined(LINEAR_DEP)
+                                    if (c0 > 0 && c1 > COEFF_MIN && c2 > COEFF_MIN &&
+                                            c3 > COEFF_MIN && c4 > COEFF_MIN && c5 < COEFF_MAX &&
+                                            c6 < COEFF_MAX && c7 < COEFF_MAX && c8 < COEFF_MAX &&
+                                            c9 < COEFF_MAX) {
+                                        skipped_count += (COEFF_MAX - COEFF_MIN + 1) * (COEFF_MAX - COEFF_MIN + 1);
+                                    } else {
+#endif
+                                        STA(10);
 #if 0
-                                                    STA(11);
-                                                        const binsquare_t binsquare = _cvtmask32_u32(_mm256_cmpneq_epi8_mask(square, _mm256_setzero_si256()));
-                                                        const size_t off = binsquare >> 6;
-                                                        const uint64_t mask = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
-                                                        if (unlikely(!(map[off] & mask))) {
-                                                            map[off] |= mask;
-                                                            innovative_count++;
-                                                            //printf("inn: "); print_square(square);
-                                                            //print_binsquare(binsquare);
-                                                        }
-                                                    END(11);
+                                            STA(11);
+                                                const binsquare_t binsquare = square_nonzero(square);
+                                                const size_t off = binsquare >> 6;
+                                                const uint64_t mask = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
+                                                if (unlikely(!(map[off] & mask))) {
+                                                    map[off] |= mask;
+                                                    innovative_count++;
+                                                    //printf("inn: "); print_square(square);
+                                                    //print_binsquare(binsquare);
+                                                }
+                                            END(11);
+#elif defined(MULTI_RANGE)
+                                            const int level10 = MR_LEVEL(level9, c10);
+                                            PUSH(11);
+                                            ADD(11, COEFF_MIN);
+                                            LOOP(11) {
+                                                uint64_t *const map = maps
+                                                    + (size_t) (MR_LEVEL(level10, c11) - 1) * BINSQUARE_MAP_WORDS;
+                                                const binsquare_t binsquare = square_nonzero(square);
+                                                INSERT(binsquare);
+                                                ADD(11, 1);
+                                            }
+                                            POP(11);
+                                            insert_count += OUTER_RADIX;
 #else
-                                                    PUSH(11);
-                                                    ADD(11, COEFF_MIN);
-                                                    __mmask32 mask = _mm256_cmpneq_epi8_mask(square, _mm256_setzero_si256());
-                                                    for (c11 = COEFF_MIN+1; c11 <= COEFF_MAX; c11 ++) {
-                                                        ADD(11, 1);
-                                                        const binsquare_t binsquare = _cvtmask32_u32(mask);
-                                                        mask = _mm256_cmpneq_epi8_mask(square, _mm256_setzero_si256());
-                                                        const size_t off = binsquare >> 6;
-                                                        const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
-                                                        if (!(map[off] & hot))
-                                                            map[off] |= hot;
-                                                    }
-                                                    const binsquare_t binsquare = _cvtmask32_u32(mask);
-                                                    const size_t off = binsquare >> 6;
-                                                    const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
-                                                    if (!(map[off] & hot))
-                                                        map[off] |= hot;
-                                                    POP(11);
-#endif
-                                                END(10);
-                                            END(9);
-                                        END(8);
-                                    END(7);
-                                END(6);
-                            END(5);
-                        END(4);
-                    END(3);
+                                            if (unlikely(ext_out == 0)) {
+                                                /* Only the values of c11 outside the old range. */
+                                                PUSH(11);
+                                                ADD(11, COEFF_MIN);
+                                                for (c11 = COEFF_MIN; c11 < ext_min; c11 ++) {
+                                                    const binsquare_t binsquare = square_nonzero(square);
+                                                    INSERT(binsquare);
+                                                    ADD(11, 1);
+                                                }
+                                                ADD(11, ext_max + 1 - ext_min);
+                                                for (c11 = ext_max + 1; c11 <= COEFF_MAX; c11 ++) {
+                                                    const binsquare_t binsquare = square_nonzero(square);
+                                                    INSERT(binsquare);
+                                                    ADD(11, 1);
+                                                }
+                                                POP(11);
+                                                insert_count += OUTER_RADIX - (ext_max - ext_min + 1);
+                                            } else
+                                            GEN_RADIX_SWITCH(OUTER_RADIX,
+                                            PUSH(11);
+                                            ADD(11, COEFF_MIN);
+                                            binsquare_t mask = square_nonzero(square);
+                                            for (c11 = COEFF_MIN+1; c11 < COEFF_MIN + gen_radix; c11 ++) {
+                                                ADD(11, 1);
+                                                const binsquare_t binsquare = mask;
+                                                mask = square_nonzero(square);
+                                                INSERT(binsquare);
+                                            }
+                                            const binsquare_t binsquare = mask;
+                                            INSERT(binsquare);
+                                            POP(11);
+                                            insert_count += gen_radix;
+                                            )
+#endif
+                                        END(10);
+#if defined(LINEAR_DEP)
+                                    }
+#endif
+#if defined(DIHEDRAL)
+                                    }
+#endif
+                                    END(9);
+                                END(8);
+                            END(7);
+                        END(6);
+                    END(5);
+#if defined(DIHEDRAL)
                 }
-            }
+#endif
+                END(4);
+            END(3);
+#endif
         }
+        PROBE_FLUSH();
 
         printf("Final square:    ");
         print_square(square);
 
-        binsquare_finalize(map);
+#if defined(MULTI_RANGE)
+        {
+            /* Every level only has its own tuples so far. */
+            size_t i;
+            for (i = BINSQUARE_MAP_WORDS; i < BINSQUARE_MAP_WORDS * MR_LEVELS; i ++)
+                map[i] |= map[i - BINSQUARE_MAP_WORDS];
+        }
+#endif
+
+        if (do_bench) {
+            /* Merge the per-thread maps as bsmap_gather would. */
+#pragma omp critical
+            if (bench_map == NULL)
+                bench_map = map;
+            else {
+                size_t i;
+                for (i = 0; i < BINSQUARE_MAP_WORDS * MR_LEVELS; i ++)
+                    bench_map[i] |= map[i];
+            }
+        } else {
+            int k;
+            for (k = 1; k <= MR_LEVELS; k ++) {
+                uint64_t *const level_map = map + (size_t) (k - 1) * BINSQUARE_MAP_WORDS;
+#if defined(DIHEDRAL_EXPAND)
+                dihedral_finalize(level_map, 1);
+#elif defined(DIHEDRAL)
+                dihedral_finalize(level_map, 0);
+#endif
+                binsquare_finalize(level_map, k);
+            }
+        }
+    }
+
+    time = omp_get_wtime() - time;
+#if defined(LINEAR_DEP)
+    printf("skipped_count = %" PRIu64 "\n", skipped_count);
+#endif
+
+    if (do_bench) {
+        int k, nfailed = 0;
+
+        bench_report(bench_tuples(outer_end - outer_begin, OUTER_RADIX, ORDER*2+2 - 3,
+                    COEFF_MAX + 1),
+                insert_count, time, omp_get_max_threads());
+        bench_tlb_report(insert_count);
+        for (k = 1; k <= MR_LEVELS; k ++) {
+            uint64_t *const level_map = bench_map + (size_t) (k - 1) * BINSQUARE_MAP_WORDS;
+            uint64_t count, checksum;
+#if defined(MULTI_RANGE)
+            printf("Level %d: COEFF_{MIN,MAX} = {%d, %d}\n", k, MR_MIN(k), MR_MAX(k));
+#endif
+#if defined(DIHEDRAL)
+            /* The references are for full maps. */
+            dihedral_finalize(level_map, 1);
+#endif
+            checksum = bench_checksum(level_map, BINSQUARE_MAP_WORDS, &count);
+            if (nshards != 0) {
+                printf("golden: Not checked for a shard\n");
+                continue;
+            }
+            nfailed += bench_check(ORDER, MR_MIN(k), MR_MAX(k), count, checksum);
+        }
+        return nfailed ? EXIT_FAILURE : 0;
+    }
+
+    if (nshards != 0) {
+        int k;
+        for (k = 1; k <= MR_LEVELS; k ++)
+            printf("Gather all shards with ./bsmap_gather bsmap.%d.%d.%d" BSMAP_SUFFIX
+                    ".shard*of%u.[0-9]*\n", ORDER, MR_MIN(k), MR_MAX(k), nshards);
+        return 0;
     }
 
+    fflush(stdout);
     {
-        char str[0x100];
-        snprintf(str, sizeof(str), "./bsmap_gather bsmap.%d.%d.%d.*",
-                ORDER, COEFF_MIN, COEFF_MAX);
+        char path[0x100], str[0x300];
+#if defined(MULTI_RANGE)
+        /* Every level has to go to its own file instead of to stdout. */
+        int k;
+        for (k = 1; k <= MR_LEVELS; k ++) {
+            bsmap_path(path, sizeof(path), k);
+            snprintf(str, sizeof(str), "./bsmap_gather %s.[0-9]* >%s", path, path);
+            if (system(str)) {
+                fprintf(stderr, "error: %s failed\n", str);
+                exit(EXIT_FAILURE);
+            }
+        }
+#else
+        bsmap_path(path, sizeof(path), 1);
+        snprintf(str, sizeof(str), "./bsmap_gather %s.[0-9]*", path);
         (void) execl("/bin/sh", "sh", "-c", str, NULL);
+#endif
     }
 
     return 0;
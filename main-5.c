@@ -17,7 +17,9 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <time.h>
 #include <immintrin.h>
 
 
@@ -41,6 +43,43 @@
 #define PREFIX ""
 #endif /* PREFIX */
 
+/*
+ * DIHEDRAL: enumerate one coefficient tuple per orbit of the symmetries of
+ * the square and write the canonical representatives only ("bsmap.*.d4").
+ * DIHEDRAL_EXPAND: same enumeration, but expand the orbits back to the full
+ * bsmap before writing it.
+ */
+#if defined(DIHEDRAL_EXPAND) && !defined(DIHEDRAL)
+#define DIHEDRAL
+#endif
+
+#if defined(DIHEDRAL) && !defined(DIHEDRAL_EXPAND)
+#define BSMAP_SUFFIX ".d4"
+#define BSMAPZ_FLAGS BSMAPZ_FLAG_D4
+#else
+#define BSMAP_SUFFIX ""
+#define BSMAPZ_FLAGS 0
+#endif
+
+/*
+ * GRAY: walk the coefficient tuples in reflected Gray order instead of the
+ * STA/END nest, so that every tuple costs exactly one line add.
+ */
+#if defined(GRAY) && defined(DIHEDRAL)
+#error "GRAY and DIHEDRAL cannot be combined"
+#endif
+
+/*
+ * LINEAR_DEP: the rows and the columns both add up to the all-ones square, so
+ * adding 1 to every row coefficient and subtracting 1 from every column one
+ * gives the same square.  Only enumerate the tuple of every such chain that
+ * cannot be moved down the chain without leaving the box, and report how
+ * many tuples were skipped.
+ */
+#if defined(LINEAR_DEP) && (defined(DIHEDRAL) || defined(GRAY))
+#error "LINEAR_DEP cannot be combined with DIHEDRAL or GRAY"
+#endif
+
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -58,6 +97,25 @@ typedef uint32_t binsquare_t;
 typedef uint64_t binsquare_t;
 #endif
 
+#if defined(DIHEDRAL)
+#include "dihedral.h"
+#endif
+
+#if defined(GRAY)
+#include "gray.h"
+#endif
+
+/*
+ * The bsmap is written in the compressed bsmapz format (see bsmapz.h) unless
+ * BSMAP_DENSE is defined, in which case the raw bitmap is dumped as before.
+ */
+#if !defined(BSMAP_DENSE)
+#include "bsmapz.h"
+#endif
+
+#include "bench.h"
+#include "bsmap_alloc.h"
+
 static void *binsquare_map = NULL;
 static const size_t binsquare_map_len = ((size_t) 1) << (ORDER*ORDER);
 
@@ -133,6 +191,9 @@ static inline binsquare_t square_addsub_line(square_t square,
     return binsquare;
 }
 
+/* Page size to back the bsmap with, see bsmap_alloc.h. */
+static enum bsmap_pages bsmap_pages = BSMAP_PAGES_THP;
+
 static void* binsquare_init(void)
 {
      void *map;
@@ -150,10 +211,14 @@ static void* binsquare_init(void)
 
 #if ORDER <= 5
 #warning "Using in-memory index"
-     if (posix_memalign(&map, 65536, size)) {
-         fprintf(stderr, "posix_memalign: %s\n", strerror(errno));
+     enum bsmap_pages got;
+
+     map = bsmap_alloc(size, bsmap_pages, &got);
+     if (map == NULL) {
+         fprintf(stderr, "bsmap_alloc: %s\n", strerror(errno));
          exit(EXIT_FAILURE);
      }
+     printf("Mapped %zu bytes (pages: %s)\n", size, bsmap_pages_names[got]);
 #else
 #warning "Using out-of-memory index"
      int fd;
@@ -196,14 +261,45 @@ static void* binsquare_init(void)
      return map;
 }
 
+/*
+ * The outer (c0, c1, c2) iterations are numbered in loop order, c2 running
+ * fastest.  A run covers the range [outer_begin, outer_end), which is a
+ * deterministic slice of them with --shard.
+ */
+#define OUTER_RADIX (COEFF_MAX - COEFF_MIN + 1)
+#define OUTER_LEN ((size_t) OUTER_RADIX * OUTER_RADIX * OUTER_RADIX)
+#define OUTER_INDEX(c0, c1, c2) \
+    ((((size_t) (c0) - COEFF_MIN) * OUTER_RADIX + (c1) - COEFF_MIN) \
+            * OUTER_RADIX + (c2) - COEFF_MIN)
+
+static size_t outer_begin = 0, outer_end = OUTER_LEN;
+
+/* Output path: "bsmap.ORDER.MIN.MAX[.d4][.shardIofN]". */
+static char bsmap_path[0x100];
+
+static void bsmap_path_init(const unsigned shard, const unsigned nshards)
+{
+    int len = snprintf(bsmap_path, sizeof(bsmap_path),
+            "bsmap." STR(ORDER) "." STR(COEFF_MIN) "." STR(COEFF_MAX) BSMAP_SUFFIX);
+    if (nshards != 0)
+        (void) snprintf(bsmap_path + len, sizeof(bsmap_path) - len,
+                ".shard%uof%u", shard, nshards);
+}
+
 static void binsquare_finalize(void)
 {
+#if !defined(BSMAP_DENSE)
+    struct bsmapz_header header;
+
+    bsmapz_header_init(&header, ORDER, COEFF_MIN, COEFF_MAX, BSMAPZ_FLAGS);
+    (void) bsmapz_write_dense(bsmap_path, &header, binsquare_map, ORDER*ORDER);
+#else
     FILE *fp;
     size_t rets;
 
-    fp = fopen("bsmap." STR(ORDER) "." STR(COEFF_MIN) "." STR(COEFF_MAX), "wb");
+    fp = fopen(bsmap_path, "wb");
     if (fp == NULL) {
-        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        fprintf(stderr, "fopen: %s: %s\n", bsmap_path, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -217,15 +313,40 @@ static void binsquare_finalize(void)
         fprintf(stderr, "fclose: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+#endif
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--bench] [--hugepages 1g|2m|thp|none] [--shard I/N]\n", argv0);
+    fprintf(stderr, "  --bench           Time the enumeration and check the bsmap instead of writing it\n");
+    fprintf(stderr, "  --hugepages SIZE  Page size of the bsmap (default: thp)\n");
+    fprintf(stderr, "  --shard I/N       Only cover the I-th of N slices of the outer loops\n");
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    static const struct option longopts[] = {
+        {"bench",     no_argument, NULL, 'B'},
+        {"hugepages", required_argument, NULL, 'H'},
+        {"shard",     required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    unsigned shard = 0, nshards = 0;
+    int do_bench = 0;
+    int opt;
     uint64_t *map = NULL;
     uint32_t innovative_count = 0;
+    uint64_t insert_count = 0;
+    struct timespec t_start, t_end;
+#if defined(LINEAR_DEP)
+    uint64_t skipped_count = 0;
+#endif
     square_t square = {0};
     binsquare_t binsquare = (binsquare_t) 0;
 
+/* The Gray walk keeps no per-level coefficients or squares. */
+#if !defined(GRAY)
 #define X(n) int c##n; square_t square_orig_c##n; binsquare_t binsquare_orig_c##n;
 
     X(0)
@@ -240,14 +361,59 @@ int main(void)
     X(9)
     X(10)
     X(11)
+#undef X
+#endif
 
 
     printf("Built on %s %s\n", __DATE__, __TIME__);
     printf("ORDER = %d\n", ORDER);
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'B':
+                do_bench = 1;
+                break;
+            case 'H':
+                if (bsmap_pages_parse(optarg, &bsmap_pages)) {
+                    fprintf(stderr, "error: Invalid page size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                if (sscanf(optarg, "%u/%u", &shard, &nshards) != 2
+                        || nshards == 0 || shard >= nshards) {
+                    fprintf(stderr, "error: Invalid shard: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
     printf("COEFF_{MIN,MAX} = {%d, %d}\n", COEFF_MIN, COEFF_MAX);
     print_square(square);
 
+    bsmap_path_init(shard, nshards);
+    if (nshards != 0) {
+#if defined(GRAY)
+        fprintf(stderr, "error: --shard is not supported with GRAY\n");
+        exit(EXIT_FAILURE);
+#endif
+        outer_begin = OUTER_LEN * shard / nshards;
+        outer_end = OUTER_LEN * (shard + 1) / nshards;
+        printf("Shard %u/%u: outer iterations [%zu, %zu) of %zu\n",
+                shard, nshards, outer_begin, outer_end, (size_t) OUTER_LEN);
+    }
+
+#if defined(DIHEDRAL)
+    dihedral_init();
+#endif
+
     map = binsquare_init();
+    if (do_bench)
+        bench_tlb_start();
+    (void) clock_gettime(CLOCK_MONOTONIC, &t_start);
 
 
 #define PUSH(n) \
@@ -269,16 +435,64 @@ int main(void)
 #define STA(n) PUSH(n); ADD(n, COEFF_MIN-1); LOOP(n) { ADD(n, 1)
 #define END(n) } POP(n)
 
+#if defined(GRAY)
+    {
+        struct gray gray;
+        int j, k, dir, dir0 = 1;
+
+        for (j = 0; j < ORDER*2+2; j ++)
+            ADD(j, COEFF_MIN);
+        /* Digit 0 (the last line) sweeps back and forth in a plain loop. */
+        gray_init(&gray, ORDER*2+2 - 1);
+        for (;;) {
+            for (k = 0; ; k ++) {
+                const size_t off = binsquare >> 6;
+                const uint64_t mask = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
+                if (unlikely(!(map[off] & mask))) {
+                    map[off] |= mask;
+                    innovative_count++;
+                }
+                if (k == GRAY_RADIX - 1)
+                    break;
+                ADD(ORDER*2+1, dir0);
+            }
+            insert_count += GRAY_RADIX;
+            dir0 = -dir0;
+            if ((j = gray_next(&gray, &dir)) < 0)
+                break;
+            ADD(ORDER*2 - j, dir);
+        }
+    }
+#else
     STA(0);
         STA(1);
             STA(2);
+                if (OUTER_INDEX(c0, c1, c2) < outer_begin
+                        || OUTER_INDEX(c0, c1, c2) >= outer_end)
+                    continue;
                 STA(3);
                     STA(4);
+#if defined(DIHEDRAL)
+                    const int t_rows[ORDER] = {c0, c1, c2, c3, c4};
+                    if (!dihedral_dominated(t_rows, ORDER)) {
+#endif
                         STA(5);
                             STA(6);
                                 STA(7);
                                     STA(8);
                                         STA(9);
+#if defined(DIHEDRAL)
+                                        const int t[ORDER*2] = {c0, c1, c2, c3, c4, c5, c6, c7, c8, c9};
+                                        if (!dihedral_dominated(t, ORDER*2)) {
+#endif
+#if defined(LINEAR_DEP)
+                                        if (c0 > COEFF_MIN && c1 > COEFF_MIN && c2 > COEFF_MIN &&
+                                                c3 > COEFF_MIN && c4 > COEFF_MIN && c5 < COEFF_MAX &&
+                                                c6 < COEFF_MAX && c7 < COEFF_MAX && c8 < COEFF_MAX &&
+                                                c9 < COEFF_MAX) {
+                                            skipped_count += (COEFF_MAX - COEFF_MIN + 1) * (COEFF_MAX - COEFF_MIN + 1);
+                                        } else {
+#endif
                                             STA(10);
                                                 STA(11);
                                                     const size_t off = binsquare >> 6;
@@ -290,17 +504,29 @@ int main(void)
                                                         //print_binsquare(binsquare);
                                                     }
                                                 END(11);
+                                                insert_count += COEFF_MAX - COEFF_MIN + 1;
                                             END(10);
+#if defined(LINEAR_DEP)
+                                        }
+#endif
+#if defined(DIHEDRAL)
+                                        }
+#endif
                                         END(9);
                                     END(8);
                                 END(7);
                             END(6);
                         END(5);
+#if defined(DIHEDRAL)
+                    }
+#endif
                     END(4);
                 END(3);
             END(2);
         END(1);
     END(0);
+#endif
+    (void) clock_gettime(CLOCK_MONOTONIC, &t_end);
 
 
     printf("Final square:    ");
@@ -308,6 +534,36 @@ int main(void)
     printf("Final binsquare: ");
     print_binsquare(binsquare);
     printf("innovate_count = %" PRIu32 "\n", innovative_count);
+#if defined(LINEAR_DEP)
+    printf("skipped_count = %" PRIu64 "\n", skipped_count);
+#endif
+
+    if (do_bench) {
+        uint64_t count, checksum;
+
+        bench_report(bench_tuples(outer_end - outer_begin, OUTER_RADIX, ORDER*2+2 - 3, OUTER_RADIX),
+                insert_count, (t_end.tv_sec - t_start.tv_sec)
+                    + (t_end.tv_nsec - t_start.tv_nsec) * 1e-9, 1);
+        bench_tlb_report(insert_count);
+#if defined(DIHEDRAL)
+        /* The references are for full maps. */
+        dihedral_finalize(map, 1);
+#endif
+        checksum = bench_checksum(map,
+                binsquare_map_len * sizeof(binsquare_t) / sizeof(uint64_t), &count);
+        if (nshards != 0) {
+            printf("golden: Not checked for a shard\n");
+            return 0;
+        }
+        return bench_check(ORDER, COEFF_MIN, COEFF_MAX, count, checksum)
+            ? EXIT_FAILURE : 0;
+    }
+
+#if defined(DIHEDRAL_EXPAND)
+    dihedral_finalize(map, 1);
+#elif defined(DIHEDRAL)
+    dihedral_finalize(map, 0);
+#endif
 
     binsquare_finalize();
     return 0;
@@ -7,6 +7,7 @@
  * software. If not, contact the copyright holder above.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -18,6 +19,11 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <inttypes.h>
 #include <immintrin.h>
 #include <omp.h>
@@ -28,6 +34,14 @@
 #endif
 #define ORDER 6
 
+#if defined(GEN_KERNEL)
+/* The coefficient range is given to gen on the command line. */
+#include "gen.h"
+#define COEFF_MIN gen_coeff_min
+#define COEFF_MAX gen_coeff_max
+#else
+#define GEN_RADIX_SWITCH(radix, ...) { const int gen_radix = (radix); __VA_ARGS__ }
+
 #if !defined(COEFF_MIN) || !defined(COEFF_MAX)
 #error "Define COEFF_MIN and COEFF_MAX"
 #endif
@@ -36,10 +50,49 @@
 #error "COEFF_MIN must be smaller or equal to COEFF_MAX"
 #endif
 
+#endif /* GEN_KERNEL */
+
 #ifndef PREFIX
 #define PREFIX ""
 #endif /* PREFIX */
 
+/*
+ * DIHEDRAL: enumerate one coefficient tuple per orbit of the symmetries of
+ * the square and write the canonical representatives only ("bsmap.*.d4").
+ * DIHEDRAL_EXPAND: same enumeration, but expand the orbits back to the full
+ * bsmap before writing it.
+ */
+#if defined(DIHEDRAL_EXPAND) && !defined(DIHEDRAL)
+#define DIHEDRAL
+#endif
+
+#if defined(DIHEDRAL) && !defined(DIHEDRAL_EXPAND)
+#define BSMAP_SUFFIX ".d4"
+#define BSMAPZ_FLAGS BSMAPZ_FLAG_D4
+#else
+#define BSMAP_SUFFIX ""
+#define BSMAPZ_FLAGS 0
+#endif
+
+/*
+ * GRAY: walk the coefficient tuples in reflected Gray order instead of the
+ * STA/END nest, so that every tuple costs exactly one line add.
+ */
+#if defined(GRAY) && defined(DIHEDRAL)
+#error "GRAY and DIHEDRAL cannot be combined"
+#endif
+
+/*
+ * LINEAR_DEP: the rows and the columns both add up to the all-ones square, so
+ * adding 1 to every row coefficient and subtracting 1 from every column one
+ * gives the same square.  Only enumerate the tuple of every such chain that
+ * cannot be moved down the chain without leaving the enumerated box (where
+ * c0 >= 0), and report how many tuples were skipped.
+ */
+#if defined(LINEAR_DEP) && (defined(DIHEDRAL) || defined(GRAY))
+#error "LINEAR_DEP cannot be combined with DIHEDRAL or GRAY"
+#endif
+
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -48,124 +101,144 @@
  * maxabs(coeff_min, coeff_max) * (2*order + 2)
  */
 typedef int_fast8_t square_elem_t;
-typedef __m512i square_t;
 typedef uint64_t binsquare_t;
 
-#define BINSQUARE_MAP_SIZE (((size_t) 1) << (ORDER*ORDER - 3))
+/*
+ * The square is one AVX-512 vector, or a pair of AVX2 vectors (the low and
+ * the high 32 cells) when built without AVX-512BW, e.g. for the AVX2 kernel
+ * of gen.
+ */
+#if defined(__AVX512BW__)
+typedef __m512i square_t;
+#define square_zero() _mm512_setzero_si512()
+#define square_add(a, b) _mm512_add_epi8(a, b)
+#define square_sub(a, b) _mm512_sub_epi8(a, b)
+#define square_nonzero(square) \
+    ((binsquare_t) _cvtmask64_u64(_mm512_cmpneq_epi8_mask(square, _mm512_setzero_si512())))
+#define square_set_epi8 _mm512_set_epi8
+#define square_store(p, square) _mm512_storeu_si512(p, square)
+#else
+typedef struct {
+    __m256i lo, hi;
+} square_t;
+
+static inline square_t square_zero(void)
+{
+    return (square_t) {_mm256_setzero_si256(), _mm256_setzero_si256()};
+}
 
-#define _mm512_extract_epi8(a, imm8) \
-    _mm_extract_epi8(_mm512_extracti32x4_epi32(a, imm8 / (128 / 8)), imm8 % (128 / 8))
+static inline square_t square_add(const square_t a, const square_t b)
+{
+    return (square_t) {_mm256_add_epi8(a.lo, b.lo), _mm256_add_epi8(a.hi, b.hi)};
+}
+
+static inline square_t square_sub(const square_t a, const square_t b)
+{
+    return (square_t) {_mm256_sub_epi8(a.lo, b.lo), _mm256_sub_epi8(a.hi, b.hi)};
+}
+
+static inline binsquare_t square_nonzero(const square_t square)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t lo = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(square.lo, zero));
+    const uint32_t hi = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(square.hi, zero));
+    return ((binsquare_t) hi << 32) | lo;
+}
+
+static inline void square_store(int8_t *p, const square_t square)
+{
+    _mm256_storeu_si256((__m256i*) p, square.lo);
+    _mm256_storeu_si256((__m256i*) (p + 32), square.hi);
+}
+
+/* Same argument order as _mm512_set_epi8. */
+#define square_set_epi8( \
+        e63, e62, e61, e60, e59, e58, e57, e56, e55, e54, e53, e52, e51, e50, \
+        e49, e48, e47, e46, e45, e44, e43, e42, e41, e40, e39, e38, e37, e36, \
+        e35, e34, e33, e32, e31, e30, e29, e28, e27, e26, e25, e24, e23, e22, \
+        e21, e20, e19, e18, e17, e16, e15, e14, e13, e12, e11, e10, e9, e8, e7, \
+        e6, e5, e4, e3, e2, e1, e0) \
+    ((square_t) {_mm256_set_epi8( \
+            e31, e30, e29, e28, e27, e26, e25, e24, e23, e22, e21, e20, e19, \
+            e18, e17, e16, e15, e14, e13, e12, e11, e10, e9, e8, e7, e6, e5, \
+            e4, e3, e2, e1, e0), \
+        _mm256_set_epi8( \
+            e63, e62, e61, e60, e59, e58, e57, e56, e55, e54, e53, e52, e51, \
+            e50, e49, e48, e47, e46, e45, e44, e43, e42, e41, e40, e39, e38, \
+            e37, e36, e35, e34, e33, e32)})
+#endif
+
+#if defined(DIHEDRAL)
+/* c0 only runs over non-negative values: t and -t give the same pattern. */
+#define DIHEDRAL_NEGATE 1
+#include "dihedral.h"
+#endif
+
+#if defined(GRAY)
+#include "gray.h"
+#endif
+
+/*
+ * The bsmap is written in the compressed bsmapz format (see bsmapz.h) unless
+ * BSMAP_DENSE is defined, in which case the raw bitmap is dumped as before.
+ * --extend-from always reads a bsmapz.
+ */
+#include "bsmapz.h"
+
+#include "bench.h"
+#include "bsmap_alloc.h"
+#include "bsmap_numa.h"
+
+#define BINSQUARE_MAP_SIZE (((size_t) 1) << (ORDER*ORDER - 3))
 
 static void print_square(square_t square)
 {
-    printf("(%2d ", (int8_t) _mm512_extract_epi8(square, 63));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 62));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 61));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 60));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 59));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 58));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 57));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 56));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 55));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 54));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 53));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 52));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 51));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 50));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 49));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 48));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 47));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 46));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 45));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 44));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 43));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 42));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 41));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 40));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 39));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 38));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 37));
-    printf("%2d) ", (int8_t) _mm512_extract_epi8(square, 36));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 35));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 34));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 33));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 32));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 31));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 30));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 29));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 28));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 27));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 26));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 25));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 24));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 23));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 22));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 21));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 20));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 19));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 18));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 17));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 16));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 15));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 14));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 13));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 12));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 11));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 10));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 9));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 8));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 7));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 6));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 5));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 4));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 3));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 2));
-    printf("%2d ", (int8_t) _mm512_extract_epi8(square, 1));
-    printf("%2d\n", (int8_t)_mm512_extract_epi8(square, 0));
+    int8_t e[64];
+    int i;
+
+    square_store(e, square);
+    printf("(");
+    for (i = 63; i >= 0; i --)
+        printf("%2d%s", e[i], i == ORDER*ORDER ? ") " : i == 0 ? "\n" : " ");
 }
 
 #define get_add(line_id, c) \
     ({ \
         square_t __attribute__((aligned(32))) adds[ORDER*2+2] = { \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c), \
-                _mm512_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0,0,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c,0,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,c,c,c,c,c), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c,0,0,0,0,0,c), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c,0,0,0,0,0,0,c), \
+                square_set_epi8(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,c,0,0,0,0,0), \
         }; \
         adds[line_id]; \
     })
 
 #define square_addsub_line(square, line_id, c) \
-    square = _mm512_add_epi8(square, get_add(line_id, c))
+    square = square_add(square, get_add(line_id, c))
 
 
-static void* my_cvalloc(const size_t size)
-{
-    intptr_t p;
-    const size_t align = 65536;
-    const size_t size_suf = size + align - 1;
-    p = (intptr_t) calloc(size_suf, 1);
-    if (p == (intptr_t) NULL)
-        return NULL;
-    const size_t mod = ((intptr_t) p) % align;
-    if (mod)
-        p += align - mod;
-    return (void*) p;
-}
+/* Page size to back the bsmap with, see bsmap_alloc.h. */
+static enum bsmap_pages bsmap_pages = BSMAP_PAGES_THP;
+/* Page size binsquare_init() actually got, for bsmap_free(). */
+static enum bsmap_pages bsmap_pages_got;
+/* Placement of the bsmap and pinning of the threads, see bsmap_numa.h. */
+static enum bsmap_numa numa_mode = BSMAP_NUMA_NONE;
+static int numa_pin = 0;
 
 static void* binsquare_init(void)
 {
      void *map;
+     enum bsmap_pages got;
 
      printf("Mapping %zu bytes\n", BINSQUARE_MAP_SIZE);
 
@@ -177,22 +250,53 @@ static void* binsquare_init(void)
       * 6     8GiB
       */
 
-     map = my_cvalloc(BINSQUARE_MAP_SIZE);
+     map = bsmap_alloc(BINSQUARE_MAP_SIZE, bsmap_pages, &got);
      if (map == NULL) {
-         fprintf(stderr, "my_cvalloc: %s\n", strerror(errno));
+         fprintf(stderr, "bsmap_alloc: %s\n", strerror(errno));
          exit(EXIT_FAILURE);
      }
+     printf("Mapped %zu bytes (pages: %s)\n", BINSQUARE_MAP_SIZE,
+             bsmap_pages_names[got]);
+     bsmap_numa_place(map, BINSQUARE_MAP_SIZE, bsmap_pages_size(got), numa_mode);
+     bsmap_pages_got = got;
 
      return map;
 }
 
+/*
+ * The outer (c0, ..., c5) iterations are numbered in loop order, c5 running
+ * fastest.  A run covers the range [outer_begin, outer_end), which is a
+ * deterministic slice of them with --shard.
+ */
+#define OUTER_RADIX (COEFF_MAX - COEFF_MIN + 1)
+#define OUTER_LEN ((size_t) (COEFF_MAX + 1) * OUTER_RADIX * OUTER_RADIX \
+        * OUTER_RADIX * OUTER_RADIX * OUTER_RADIX)
+
+static size_t outer_begin, outer_end;
+
+/* Output path without extension: "bsmap.ORDER.MIN.MAX[.d4][.shardIofN]". */
+static char bsmap_path[0x100];
+
+static void bsmap_path_init(const unsigned shard, const unsigned nshards)
+{
+    int len = snprintf(bsmap_path, sizeof(bsmap_path), "bsmap.%d.%d.%d" BSMAP_SUFFIX,
+            ORDER, COEFF_MIN, COEFF_MAX);
+    if (nshards != 0)
+        (void) snprintf(bsmap_path + len, sizeof(bsmap_path) - len,
+                ".shard%uof%u", shard, nshards);
+}
+
 static void binsquare_finalize(void *map)
 {
+#if !defined(BSMAP_DENSE)
+    struct bsmapz_header header;
+
+    bsmapz_header_init(&header, ORDER, COEFF_MIN, COEFF_MAX, BSMAPZ_FLAGS);
+    (void) bsmapz_write_dense(bsmap_path, &header, map, ORDER*ORDER);
+#else
     FILE *fp;
     size_t rets;
-    char str[0x100];
-
-    snprintf(str, sizeof(str), "bsmap.%d.%d.%d", ORDER, COEFF_MIN, COEFF_MAX);
+    const char *str = bsmap_path;
 
     fp = fopen(str, "wb");
     if (fp == NULL) {
@@ -210,13 +314,623 @@ static void binsquare_finalize(void *map)
         fprintf(stderr, "fclose: %s: %s\n", str, strerror(errno));
         exit(EXIT_FAILURE);
     }
+#endif
 }
 
-int main(void)
+/*
+ * Checkpoint/resume.
+ *
+ * A checkpoint consists of the bsmap ("bsmap.*.ckpt") and one byte per outer
+ * (c0, ..., c5) iteration telling whether it has completed ("bsmap.*.done").
+ * The map is split into regions that are flagged dirty whenever a new pattern
+ * is inserted, and a checkpoint only rewrites the dirty regions, from a
+ * separate thread, while the enumeration goes on.  The done set is
+ * snapshotted before the map is written, so every iteration it lists has all
+ * of its patterns in the checkpointed map; iterations in flight are simply
+ * redone after --resume.
+ */
+#define CKPT_REGION_SHIFT 21 /* 2 MiB */
+#define CKPT_REGION_SIZE (((size_t) 1) << CKPT_REGION_SHIFT)
+#define CKPT_NREGIONS (BINSQUARE_MAP_SIZE >> CKPT_REGION_SHIFT)
+
+static uint8_t *ckpt_dirty = NULL; /* [CKPT_NREGIONS] */
+static uint8_t *ckpt_done = NULL;  /* [OUTER_LEN] */
+
+static struct {
+    const uint64_t *map;
+    uint8_t *done; /* Snapshot of ckpt_done, [OUTER_LEN] */
+    int fd;
+    char map_path[0x110], done_path[0x110];
+    unsigned interval;
+    int stop;
+    pthread_t thread;
+} ckpt;
+
+static inline void ckpt_mark_dirty(const binsquare_t binsquare)
 {
-    printf("Built on %s %s\n", __DATE__, __TIME__);
-    printf("ORDER = %d\n", ORDER);
-    printf("COEFF_{MIN,MAX} = {%d, %d}\n", COEFF_MIN, COEFF_MAX);
+    if (ckpt_dirty != NULL)
+        __atomic_store_n(&ckpt_dirty[(binsquare >> 3) >> CKPT_REGION_SHIFT], 1,
+                __ATOMIC_RELEASE);
+}
+
+static void ckpt_write(void)
+{
+    uint8_t *done = ckpt.done;
+    size_t i, ndone = 0, nregions = 0;
+    const double t = omp_get_wtime();
+    char tmp_path[0x120];
+    FILE *fp;
+
+    for (i = 0; i < OUTER_LEN; i ++)
+        ndone += done[i] = __atomic_load_n(&ckpt_done[i], __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < CKPT_NREGIONS; i ++) {
+        const size_t pos = i << CKPT_REGION_SHIFT;
+        if (!__atomic_exchange_n(&ckpt_dirty[i], 0, __ATOMIC_ACQUIRE))
+            continue;
+        if (pwrite(ckpt.fd, (const uint8_t*) ckpt.map + pos, CKPT_REGION_SIZE, pos)
+                != (ssize_t) CKPT_REGION_SIZE) {
+            fprintf(stderr, "pwrite: %s: %s\n", ckpt.map_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        nregions ++;
+    }
+    if (fdatasync(ckpt.fd)) {
+        fprintf(stderr, "fdatasync: %s: %s\n", ckpt.map_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ckpt.done_path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen: %s: %s\n", tmp_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(done, 1, OUTER_LEN, fp) != OUTER_LEN) {
+        fprintf(stderr, "fwrite: %s: %s\n", tmp_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (fflush(fp) || fsync(fileno(fp)) || fclose(fp)) {
+        fprintf(stderr, "fclose: %s: %s\n", tmp_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (rename(tmp_path, ckpt.done_path)) {
+        fprintf(stderr, "rename: %s: %s\n", ckpt.done_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Checkpoint: %zu/%zu outer iterations done, "
+            "%zu dirty region(s) (%zu MiB) written in %.3f s\n",
+            ndone, (size_t) OUTER_LEN, nregions,
+            nregions * CKPT_REGION_SIZE >> 20, omp_get_wtime() - t);
+}
+
+/* Write a checkpoint every ckpt.interval seconds (if non-zero) and on SIGUSR1. */
+static void* ckpt_thread(void *arg)
+{
+    sigset_t set;
+    const struct timespec ts = {ckpt.interval, 0};
+
+    (void) arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    for (;;) {
+        const int sig = ckpt.interval ? sigtimedwait(&set, NULL, &ts)
+                                      : sigwaitinfo(&set, NULL);
+        if (sig < 0 && errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "sigtimedwait: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (__atomic_load_n(&ckpt.stop, __ATOMIC_ACQUIRE))
+            break;
+        if (sig == SIGUSR1 || (sig < 0 && errno == EAGAIN))
+            ckpt_write();
+    }
+    return NULL;
+}
+
+static void read_full(const int fd, void *buf, const size_t size,
+        const off_t offset, const char *path)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        const ssize_t rets = pread(fd, (uint8_t*) buf + pos, size - pos,
+                offset + pos);
+        if (rets <= 0) {
+            fprintf(stderr, "pread: %s: %s\n", path,
+                    rets == 0 ? "Unexpected EOF" : strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        pos += rets;
+    }
+}
+
+/*
+ * Load the checkpointed map, copying only the pages that hold patterns so
+ * that the untouched part of map stays unpopulated.
+ */
+static void ckpt_load_map(uint64_t *map)
+{
+    const size_t page = 4096;
+    uint8_t *buf;
+    size_t pos, i, j;
+
+    buf = malloc(CKPT_REGION_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (pos = 0; pos < BINSQUARE_MAP_SIZE; pos += CKPT_REGION_SIZE) {
+        read_full(ckpt.fd, buf, CKPT_REGION_SIZE, pos, ckpt.map_path);
+        for (i = 0; i < CKPT_REGION_SIZE; i += page) {
+            const uint64_t *p = (const uint64_t*) (buf + i);
+            for (j = 0; j < page / sizeof(*p); j ++)
+                if (p[j] != 0)
+                    break;
+            if (j != page / sizeof(*p))
+                (void) memcpy((uint8_t*) map + pos + i, buf + i, page);
+        }
+    }
+    free(buf);
+}
+
+/*
+ * Open the checkpoint files, load them into map and the done set if resume
+ * is non-zero, and start the checkpoint thread.  SIGUSR1 is blocked in the
+ * calling thread so that the threads created later leave it to the
+ * checkpoint thread.
+ */
+static void ckpt_start(uint64_t *map, const unsigned interval, const int resume)
+{
+    sigset_t set;
+    int err;
+
+    snprintf(ckpt.map_path, sizeof(ckpt.map_path), "%s.ckpt", bsmap_path);
+    snprintf(ckpt.done_path, sizeof(ckpt.done_path), "%s.done", bsmap_path);
+    ckpt.map = map;
+    ckpt.interval = interval;
+
+    ckpt_dirty = calloc(CKPT_NREGIONS, 1);
+    ckpt_done = calloc(OUTER_LEN, 1);
+    ckpt.done = malloc(OUTER_LEN);
+    if (ckpt_dirty == NULL || ckpt_done == NULL || ckpt.done == NULL) {
+        fprintf(stderr, "calloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    ckpt.fd = open(ckpt.map_path, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC),
+            S_IRUSR | S_IWUSR);
+    if (ckpt.fd < 0) {
+        fprintf(stderr, "open: %s: %s\n", ckpt.map_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (resume) {
+        const int fd = open(ckpt.done_path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "open: %s: %s\n", ckpt.done_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        read_full(fd, ckpt_done, OUTER_LEN, 0, ckpt.done_path);
+        (void) close(fd);
+        printf("Resuming from %s\n", ckpt.map_path);
+        ckpt_load_map(map);
+    } else if (ftruncate(ckpt.fd, BINSQUARE_MAP_SIZE)) {
+        fprintf(stderr, "ftruncate: %s: %s\n", ckpt.map_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_sigmask: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    err = pthread_create(&ckpt.thread, NULL, ckpt_thread, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void ckpt_stop(void)
+{
+    __atomic_store_n(&ckpt.stop, 1, __ATOMIC_RELEASE);
+    (void) pthread_kill(ckpt.thread, SIGUSR1);
+    (void) pthread_join(ckpt.thread, NULL);
+    (void) close(ckpt.fd);
+}
+
+/*
+ * Progress report.
+ *
+ * Every thread publishes its own counters to its own cache line once per
+ * outer iteration, so the enumeration never writes shared data for it.  A
+ * separate thread sums them up every progress.interval seconds and prints
+ * throughput, discovery rate and ETA, and appends the same figures to the
+ * stats file if there is one.
+ */
+struct progress_slot {
+    uint64_t nouter;      /* Completed outer iterations */
+    uint64_t ninserts;    /* Patterns looked up */
+    uint64_t ninnovative; /* New patterns found */
+} __attribute__((aligned(64)));
+
+static struct {
+    struct progress_slot *slots; /* [nslots] */
+    int nslots;
+    size_t nouter;   /* Outer iterations to do in this run */
+    unsigned interval;
+    FILE *stats;
+    double start;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} progress;
+
+static inline void progress_update(const uint64_t nouter,
+        const uint64_t ninserts, const uint64_t ninnovative)
+{
+    struct progress_slot *slot;
+
+    if (progress.slots == NULL)
+        return;
+    slot = &progress.slots[omp_get_thread_num()];
+    __atomic_store_n(&slot->nouter, nouter, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ninserts, ninserts, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ninnovative, ninnovative, __ATOMIC_RELAXED);
+}
+
+static void progress_print(uint64_t *last, double *last_t)
+{
+    uint64_t nouter = 0, ninserts = 0, ninnovative = 0;
+    const double t = omp_get_wtime(), elapsed = t - progress.start;
+    double eta = -1;
+    char eta_str[0x20] = "-";
+    int i;
+
+    for (i = 0; i < progress.nslots; i ++) {
+        const struct progress_slot *slot = &progress.slots[i];
+        nouter += __atomic_load_n(&slot->nouter, __ATOMIC_RELAXED);
+        ninserts += __atomic_load_n(&slot->ninserts, __ATOMIC_RELAXED);
+        ninnovative += __atomic_load_n(&slot->ninnovative, __ATOMIC_RELAXED);
+    }
+    if (nouter != 0) {
+        const unsigned long s = eta = elapsed * (progress.nouter - nouter) / nouter;
+        snprintf(eta_str, sizeof(eta_str), "%lud%02lu:%02lu:%02lu",
+                s / 86400, s / 3600 % 24, s / 60 % 60, s % 60);
+    }
+
+    /* Rates are over the last interval, the ETA over the whole run. */
+    fprintf(stderr, "Progress: %" PRIu64 "/%zu outer iterations (%.2f%%), "
+            "%.3e inserts/s, %.3e new patterns/s, %" PRIu64 " patterns, ETA %s\n",
+            nouter, progress.nouter, 100.0 * nouter / progress.nouter,
+            (ninserts - last[0]) / (t - *last_t),
+            (ninnovative - last[1]) / (t - *last_t), ninnovative, eta_str);
+    if (progress.stats != NULL) {
+        fprintf(progress.stats, "%.3f\t%" PRIu64 "\t%zu\t%" PRIu64 "\t%" PRIu64
+                "\t%.0f\n", elapsed, nouter, progress.nouter, ninserts,
+                ninnovative, eta);
+        fflush(progress.stats);
+    }
+    last[0] = ninserts;
+    last[1] = ninnovative;
+    *last_t = t;
+}
+
+static void* progress_thread(void *arg)
+{
+    uint64_t last[2] = {0, 0};
+    double last_t = progress.start;
+    struct timespec ts;
+
+    (void) arg;
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    (void) pthread_mutex_lock(&progress.lock);
+    while (!progress.stop) {
+        ts.tv_sec += progress.interval;
+        while (!progress.stop
+                && pthread_cond_timedwait(&progress.cond, &progress.lock, &ts) != ETIMEDOUT)
+            ;
+        progress_print(last, &last_t);
+    }
+    (void) pthread_mutex_unlock(&progress.lock);
+    return NULL;
+}
+
+/*
+ * Report every interval seconds (and once at the end), appending to
+ * stats_path unless it is NULL.  Call after ckpt_start so that iterations
+ * restored by --resume are not counted.
+ */
+static void progress_start(const unsigned interval, const char *stats_path)
+{
+    size_t outer;
+    int err;
+
+    progress.nslots = omp_get_max_threads();
+    if (posix_memalign((void**) &progress.slots, 64,
+                sizeof(*progress.slots) * progress.nslots)) {
+        fprintf(stderr, "posix_memalign: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    (void) memset(progress.slots, 0, sizeof(*progress.slots) * progress.nslots);
+    progress.nouter = 0;
+    for (outer = outer_begin; outer < outer_end; outer ++)
+        if (ckpt_done == NULL || !ckpt_done[outer])
+            progress.nouter ++;
+    progress.interval = interval;
+
+    if (stats_path != NULL) {
+        progress.stats = fopen(stats_path, "a");
+        if (progress.stats == NULL) {
+            fprintf(stderr, "fopen: %s: %s\n", stats_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(progress.stats, "# elapsed_s\touter_done\touter_total\tinserts"
+                "\tinnovative\teta_s\n");
+    }
+
+    progress.start = omp_get_wtime();
+    progress.stop = 0;
+    (void) pthread_mutex_init(&progress.lock, NULL);
+    (void) pthread_cond_init(&progress.cond, NULL);
+    err = pthread_create(&progress.thread, NULL, progress_thread, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void progress_stop(void)
+{
+    (void) pthread_mutex_lock(&progress.lock);
+    progress.stop = 1;
+    (void) pthread_cond_signal(&progress.cond);
+    (void) pthread_mutex_unlock(&progress.lock);
+    (void) pthread_join(progress.thread, NULL);
+    if (progress.stats != NULL && fclose(progress.stats)) {
+        fprintf(stderr, "fclose: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(progress.slots);
+    progress.slots = NULL;
+}
+
+/*
+ * --extend-from: the map starts out as an existing bsmap of the range
+ * [ext_min, ext_max] and only the tuples with at least one coefficient
+ * outside of it are enumerated.  The innermost loop of a tuple whose other
+ * coefficients are all inside skips the inside values, so the work is
+ * proportional to the new shell.  The range is empty without --extend-from.
+ *
+ * Whether the coefficients of the enclosing loops are all inside is kept as
+ * the count ext_out of those outside, updated by STA/END as the loops step
+ * and only with --extend-from (ext_on), so the innermost loop only tests it.
+ */
+static int ext_min = 1, ext_max = 0;
+static FILE *ext_fp = NULL;
+static const char *ext_path = "";
+#define EXT_IN(c) ((c) >= ext_min && (c) <= ext_max)
+
+/* Open path and take its range as the one to extend from. */
+static void extend_open(const char *path)
+{
+    struct bsmapz_header header;
+
+    ext_fp = bsmapz_open(path, &header);
+    if (header.order != ORDER || (header.flags & BSMAPZ_FLAG_D4)
+            || header.coeff_min > header.coeff_max
+            || header.coeff_min < COEFF_MIN || header.coeff_max > COEFF_MAX) {
+        fprintf(stderr, "error: %s: Not a full ORDER=%d bsmap of a range within "
+                "{%d, %d}\n", path, ORDER, COEFF_MIN, COEFF_MAX);
+        exit(EXIT_FAILURE);
+    }
+    ext_path = path;
+    ext_min = header.coeff_min;
+    ext_max = header.coeff_max;
+}
+
+/* OR the bsmap opened by extend_open into map. */
+static void extend_read(uint64_t *map)
+{
+    const uint64_t count = bsmapz_read_dense(ext_fp, ext_path, map, ORDER*ORDER);
+    printf("Extending %s: COEFF_{MIN,MAX} = {%d, %d}, %" PRIu64 " patterns\n",
+            ext_path, ext_min, ext_max, count);
+    ext_fp = NULL;
+}
+
+/* Flag the regions of the checkpoint that hold any pattern dirty. */
+static void ckpt_mark_loaded(const uint64_t *map)
+{
+    size_t i, j;
+
+    for (i = 0; i < CKPT_NREGIONS; i ++) {
+        const uint64_t *p = map + (i << CKPT_REGION_SHIFT) / sizeof(*p);
+        for (j = 0; j < CKPT_REGION_SIZE / sizeof(*p); j ++)
+            if (p[j] != 0)
+                break;
+        if (j != CKPT_REGION_SIZE / sizeof(*p))
+            ckpt_dirty[i] = 1;
+    }
+}
+
+/*
+ * Set the bit of binsquare in map and return non-zero if it was not set yet.
+ *
+ * The relaxed load filters out the common case where the pattern is already
+ * known without taking the cache line exclusive; only new patterns pay for
+ * the locked fetch-or.  Concurrent inserts of the same pattern are resolved
+ * by the old value returned from the fetch-or, so each pattern is counted
+ * exactly once.
+ */
+static inline int bsmap_insert_atomic(uint64_t *map, const binsquare_t binsquare)
+{
+    const size_t off = binsquare >> 6;
+    const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
+    if (likely(__atomic_load_n(&map[off], __ATOMIC_RELAXED) & hot))
+        return 0;
+    return !(__atomic_fetch_or(&map[off], hot, __ATOMIC_RELAXED) & hot);
+}
+
+/* The original double-checked global critical section. */
+static inline int bsmap_insert_critical(uint64_t *map, const binsquare_t binsquare)
+{
+    const size_t off = binsquare >> 6;
+    const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
+    int new = 0;
+    if (!(map[off] & hot)) {
+#pragma omp critical
+        if (!(map[off] & hot)) {
+            map[off] |= hot;
+            new = 1;
+        }
+    }
+    return new;
+}
+
+/*
+ * Shard-owned map: the map is split into one contiguous range per thread and
+ * only the owner ever touches its range, so it is updated without atomics.
+ * Producers stage binsquares per destination shard and hand them over in
+ * batches through a single-producer single-consumer ring per
+ * (producer, owner) pair.  A producer waiting for ring space drains its own
+ * incoming rings meanwhile, so two threads can never wait on each other.
+ */
+#define SHARD_RING_LEN  4096
+#define SHARD_BATCH_LEN 64
+
+struct shard_ring {
+    size_t head __attribute__((aligned(64))); /* Written by the owner. */
+    size_t tail __attribute__((aligned(64))); /* Written by the producer. */
+    binsquare_t buf[SHARD_RING_LEN] __attribute__((aligned(64)));
+};
+
+struct shard_ctx {
+    uint64_t *map;
+    struct shard_ring *rings; /* [producer * nshards + owner] */
+    unsigned *nproducers_done;
+    unsigned nshards, tid;
+    binsquare_t (*batch)[SHARD_BATCH_LEN];
+    unsigned *batch_len;
+    uint64_t innovative_count;
+};
+
+static inline unsigned shard_of(const binsquare_t binsquare, const unsigned nshards)
+{
+    return ((binsquare >> 6) * nshards) >> (ORDER*ORDER - 6);
+}
+
+static inline void shard_apply(struct shard_ctx *ctx, const binsquare_t binsquare)
+{
+    const size_t off = binsquare >> 6;
+    const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
+    if (!(ctx->map[off] & hot)) {
+        ctx->map[off] |= hot;
+        ctx->innovative_count ++;
+        ckpt_mark_dirty(binsquare);
+    }
+}
+
+static void shard_drain(struct shard_ctx *ctx)
+{
+    unsigned p;
+    for (p = 0; p < ctx->nshards; p ++) {
+        struct shard_ring *ring = &ctx->rings[p * ctx->nshards + ctx->tid];
+        size_t head = ring->head;
+        const size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head ++)
+            shard_apply(ctx, ring->buf[head % SHARD_RING_LEN]);
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void shard_push(struct shard_ctx *ctx, const unsigned owner)
+{
+    struct shard_ring *ring = &ctx->rings[ctx->tid * ctx->nshards + owner];
+    const unsigned len = ctx->batch_len[owner];
+    size_t tail = ring->tail;
+    unsigned i;
+
+    while (tail + len - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > SHARD_RING_LEN) {
+        shard_drain(ctx);
+        _mm_pause();
+    }
+    for (i = 0; i < len; i ++, tail ++)
+        ring->buf[tail % SHARD_RING_LEN] = ctx->batch[owner][i];
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    ctx->batch_len[owner] = 0;
+}
+
+static inline void shard_emit(struct shard_ctx *ctx, const binsquare_t binsquare)
+{
+    const unsigned owner = shard_of(binsquare, ctx->nshards);
+    if (owner == ctx->tid) {
+        shard_apply(ctx, binsquare);
+        return;
+    }
+    ctx->batch[owner][ctx->batch_len[owner] ++] = binsquare;
+    if (unlikely(ctx->batch_len[owner] == SHARD_BATCH_LEN))
+        shard_push(ctx, owner);
+}
+
+static void shard_init(struct shard_ctx *ctx, uint64_t *map,
+        struct shard_ring **ringsp, unsigned *nproducers_done)
+{
+    ctx->nshards = omp_get_num_threads();
+    ctx->tid = omp_get_thread_num();
+
+#pragma omp single
+    {
+        const size_t size = sizeof(**ringsp) * ctx->nshards * ctx->nshards;
+        if (posix_memalign((void**) ringsp, 64, size)) {
+            fprintf(stderr, "posix_memalign: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        (void) memset(*ringsp, 0, size);
+        *nproducers_done = 0;
+    }
+
+    ctx->map = map;
+    ctx->rings = *ringsp;
+    ctx->nproducers_done = nproducers_done;
+    ctx->batch = malloc(sizeof(*ctx->batch) * ctx->nshards);
+    ctx->batch_len = calloc(ctx->nshards, sizeof(*ctx->batch_len));
+    if (ctx->batch == NULL || ctx->batch_len == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ctx->innovative_count = 0;
+}
+
+/* Hand over the remaining batches and apply everything sent to this shard. */
+static void shard_finish(struct shard_ctx *ctx)
+{
+    unsigned s, done;
+
+    for (s = 0; s < ctx->nshards; s ++)
+        if (ctx->batch_len[s] != 0)
+            shard_push(ctx, s);
+    __atomic_fetch_add(ctx->nproducers_done, 1, __ATOMIC_RELEASE);
+
+    do {
+        done = __atomic_load_n(ctx->nproducers_done, __ATOMIC_ACQUIRE);
+        shard_drain(ctx);
+    } while (done != ctx->nshards);
+
+    free(ctx->batch);
+    free(ctx->batch_len);
+}
+
+enum insert_mode {
+    INSERT_ATOMIC,
+    INSERT_CRITICAL,
+    INSERT_SHARDED,
+};
 
 #define PUSH(n) square_orig_c##n = square
 
@@ -226,16 +940,122 @@ int main(void)
 
 #define POP(n) square = square_orig_c##n
 
-#define STA(n) PUSH(n); ADD(n, COEFF_MIN); LOOP(n) {
-#define END(n) ADD(n, 1); } POP(n)
+#define EXT_STEP(n, op) do { if (ext_on) ext_out op !EXT_IN(c##n); } while (0)
 
-    uint64_t *map = binsquare_init();
+#define STA(n) PUSH(n); ADD(n, COEFF_MIN); LOOP(n) { EXT_STEP(n, +=);
+#define END(n) EXT_STEP(n, -=); ADD(n, 1); } POP(n)
+
+#define PROBE(binsquare) \
+    do { \
+        if ((mode == INSERT_ATOMIC) \
+                ? bsmap_insert_atomic(map, binsquare) \
+                : bsmap_insert_critical(map, binsquare)) { \
+            innovative_count ++; \
+            ckpt_mark_dirty(binsquare); \
+        } \
+    } while (0)
+
+/*
+ * With probe_batch, INSERT only prefetches the map word of binsquare and
+ * stages it; the whole batch is probed once it is full, so that up to
+ * probe_batch misses are in flight instead of one.  The batch is flushed
+ * before an outer iteration is marked done for the checkpoint.
+ */
+#define INSERT(binsquare) \
+    do { \
+        if (filter_bits != 0) { \
+            binsquare_t *const slot_ = &filter[FILTER_INDEX(binsquare)]; \
+            if (*slot_ == (binsquare)) { \
+                filter_hits ++; \
+                break; \
+            } \
+            *slot_ = (binsquare); \
+        } \
+        if (mode == INSERT_SHARDED) \
+            shard_emit(&shard, binsquare); \
+        else if (probe_batch != 0) { \
+            __builtin_prefetch(&map[(binsquare) >> 6]); \
+            probe_buf[probe_len ++] = (binsquare); \
+            if (probe_len == probe_batch) \
+                PROBE_FLUSH(); \
+        } else \
+            PROBE(binsquare); \
+    } while (0)
+
+#define PROBE_FLUSH() \
+    do { \
+        unsigned i_; \
+        for (i_ = 0; i_ < probe_len; i_ ++) \
+            PROBE(probe_buf[i_]); \
+        probe_len = 0; \
+    } while (0)
+
+/* Batch size of the probe stage, 0 to probe every binsquare at once. */
+#define PROBE_BATCH_MAX 256
+static unsigned probe_batch = 64;
+
+/*
+ * Recently seen filter: a direct-mapped per-thread cache of 1 << filter_bits
+ * binsquares that are already in the map (or on their way to their owner),
+ * checked before the map.  A hit skips the random read of the map; a miss
+ * probes as usual and takes the slot.  Empty slots hold FILTER_EMPTY, which
+ * has bits above ORDER*ORDER set and so is no binsquare.
+ */
+#define FILTER_BITS_MAX 20
+#define FILTER_EMPTY (~(binsquare_t) 0)
+#define FILTER_INDEX(binsquare) \
+    ((size_t) (((uint64_t) (binsquare) * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - filter_bits)))
+static unsigned filter_bits = 0;
+
+#define PROGRESS_UPDATE() \
+    progress_update(++ nouter, insert_count, innovative_count \
+            + (mode == INSERT_SHARDED ? shard.innovative_count : 0))
+
+/*
+ * Tuples skipped, patterns inserted and inserts served by the filter in the
+ * last enumerate() call.
+ */
+static uint64_t skipped_count, insert_count, filter_hits;
+
+static uint64_t enumerate(uint64_t *map, const enum insert_mode mode)
+{
+    uint64_t innovative_count = 0;
+    struct shard_ring *shard_rings = NULL;
+    unsigned shard_nproducers_done;
+
+    skipped_count = 0;
+    insert_count = 0;
+    filter_hits = 0;
 
-#pragma omp parallel firstprivate(map)
+#pragma omp parallel firstprivate(map) \
+        reduction(+:innovative_count, skipped_count, insert_count, filter_hits)
     {
         square_t square;
+        size_t outer;
+        uint64_t nouter = 0;
         int c0, c1, c2, c3, c4, c5;
+        struct shard_ctx shard;
+        binsquare_t probe_buf[PROBE_BATCH_MAX];
+        unsigned probe_len = 0;
+        binsquare_t *filter = NULL;
 
+        if (numa_pin)
+            bsmap_numa_pin(omp_get_thread_num(), omp_get_num_threads());
+        if (filter_bits != 0) {
+            const size_t len = ((size_t) 1) << filter_bits;
+            size_t i;
+            if (posix_memalign((void**) &filter, 64, sizeof(*filter) * len)) {
+                fprintf(stderr, "posix_memalign: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            for (i = 0; i < len; i ++)
+                filter[i] = FILTER_EMPTY;
+        }
+        if (mode == INSERT_SHARDED)
+            shard_init(&shard, map, &shard_rings, &shard_nproducers_done);
+
+/* The Gray walk keeps no per-level coefficients or squares. */
+#if !defined(GRAY)
 #define X(n) int c##n; square_t square_orig_c##n;
             X(6)
             X(7)
@@ -246,92 +1066,609 @@ int main(void)
             X(12)
             X(13)
 #undef X
+        const int ext_on = ext_min <= ext_max;
+        int ext_out;
+#endif
 
-#pragma omp for nowait collapse(6)
-        for (c0 = 0; c0 <= COEFF_MAX; c0 ++) {
-            for (c1 = COEFF_MIN; c1 <= COEFF_MAX; c1 ++) {
-                for (c2 = COEFF_MIN; c2 <= COEFF_MAX; c2 ++) {
-                    for (c3 = COEFF_MIN; c3 <= COEFF_MAX; c3 ++) {
-                        for (c4 = COEFF_MIN; c4 <= COEFF_MAX; c4 ++) {
-                            for (c5 = COEFF_MIN; c5 <= COEFF_MAX; c5 ++) {
-                                square = _mm512_setzero_si512();
-                                ADD(0, c0);
-                                ADD(1, c1);
-                                ADD(2, c2);
-                                ADD(3, c3);
-                                ADD(4, c4);
-                                ADD(5, c5);
-                                STA(6);
-                                    STA(7);
-                                        STA(8);
-                                            STA(9);
-                                                STA(10);
-                                                    STA(11);
-                                                        STA(12);
-#if 0
-                                                            STA(11);
-                                                                const binsquare_t binsquare = _cvtmask32_u32(_mm256_cmpneq_epi8_mask(square, _mm256_setzero_si256()));
-                                                                const size_t off = binsquare >> 6;
-                                                                const uint64_t mask = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
-                                                                if (unlikely(!(map[off] & mask))) {
-                                                                    map[off] |= mask;
-                                                                    innovative_count++;
-                                                                    //printf("inn: "); print_square(square);
-                                                                    //print_binsquare(binsquare);
-                                                                }
-                                                            END(11);
-#else
-                                                            PUSH(13);
-                                                            ADD(13, COEFF_MIN);
-                                                            __mmask64 mask = _mm512_cmpneq_epi8_mask(square, _mm512_setzero_si512());
-                                                            for (c13 = COEFF_MIN+1; c13 <= COEFF_MAX; c13 ++) {
-                                                                ADD(13, 1);
-                                                                const binsquare_t binsquare = _cvtmask64_u64(mask);
-                                                                mask = _mm512_cmpneq_epi8_mask(square, _mm512_setzero_si512());
-                                                                const size_t off = binsquare >> 6;
-                                                                const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
-                                                                if (!(map[off] & hot)) {
-#pragma omp critical
-                                                                    if (!(map[off] & hot))
-                                                                        map[off] |= hot;
-                                                                }
-                                                            }
-                                                            const binsquare_t binsquare = _cvtmask64_u64(mask);
-                                                            const size_t off = binsquare >> 6;
-                                                            const uint64_t hot = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
-                                                            if (!(map[off] & hot)) {
-#pragma omp critical
-                                                                if (!(map[off] & hot))
-                                                                    map[off] |= hot;
-                                                            }
-                                                            POP(13);
+#if defined(GRAY)
+        square_t gray_step[2][ORDER*2+2];
+        {
+            int l;
+            for (l = 0; l < ORDER*2+2; l ++) {
+                gray_step[0][l] = get_add(l, -1);
+                gray_step[1][l] = get_add(l, 1);
+            }
+        }
+#endif
+
+#pragma omp for nowait
+        for (outer = outer_begin; outer < outer_end; outer ++) {
+            size_t rest = outer;
+            c5 = COEFF_MIN + rest % OUTER_RADIX;
+            rest /= OUTER_RADIX;
+            c4 = COEFF_MIN + rest % OUTER_RADIX;
+            rest /= OUTER_RADIX;
+            c3 = COEFF_MIN + rest % OUTER_RADIX;
+            rest /= OUTER_RADIX;
+            c2 = COEFF_MIN + rest % OUTER_RADIX;
+            rest /= OUTER_RADIX;
+            c1 = COEFF_MIN + rest % OUTER_RADIX;
+            c0 = rest / OUTER_RADIX;
+
+            if (ckpt_done != NULL
+                    && __atomic_load_n(&ckpt_done[outer], __ATOMIC_RELAXED))
+                continue;
+#if defined(DIHEDRAL)
+            {
+                const int t[ORDER] = {c0, c1, c2, c3, c4, c5};
+                if (dihedral_dominated(t, ORDER)) {
+                    PROGRESS_UPDATE();
+                    continue;
+                }
+            }
 #endif
-                                                        END(12);
-                                                    END(11);
-                                                END(10);
-                                            END(9);
-                                        END(8);
-                                    END(7);
-                                END(6);
-                            }
-                        }
+            square = square_zero();
+            ADD(0, c0);
+            ADD(1, c1);
+            ADD(2, c2);
+            ADD(3, c3);
+            ADD(4, c4);
+            ADD(5, c5);
+#if defined(GRAY)
+            {
+                struct gray gray;
+                int j, k, dir;
+                square_t step0 = gray_step[1][ORDER*2+1];
+
+                for (j = 6; j < ORDER*2+2; j ++)
+                    ADD(j, COEFF_MIN);
+                /* Digit 0 (the last line) sweeps back and forth in a plain loop. */
+                gray_init(&gray, ORDER*2+2 - 6 - 1);
+                for (;;) {
+                    for (k = 0; ; k ++) {
+                        const binsquare_t binsquare = square_nonzero(square);
+                        INSERT(binsquare);
+                        if (k == GRAY_RADIX - 1)
+                            break;
+                        square = square_add(square, step0);
                     }
+                    insert_count += GRAY_RADIX;
+                    step0 = square_sub(square_zero(), step0);
+                    if ((j = gray_next(&gray, &dir)) < 0)
+                        break;
+                    square = square_add(square, gray_step[dir > 0][ORDER*2 - j]);
                 }
             }
+#else
+            ext_out = ext_on ? !EXT_IN(c0) + !EXT_IN(c1) + !EXT_IN(c2)
+                + !EXT_IN(c3) + !EXT_IN(c4) + !EXT_IN(c5) : 1;
+            STA(6);
+                STA(7);
+                    STA(8);
+                        STA(9);
+                            STA(10);
+                                STA(11);
+#if defined(DIHEDRAL)
+                                const int t[ORDER*2] = {c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11};
+                                if (!dihedral_dominated(t, ORDER*2)) {
+#endif
+#if defined(LINEAR_DEP)
+                                if (c0 > 0 && c1 > COEFF_MIN && c2 > COEFF_MIN &&
+                                        c3 > COEFF_MIN && c4 > COEFF_MIN && c5 > COEFF_MIN &&
+                                        c6 < COEFF_MAX && c7 < COEFF_MAX && c8 < COEFF_MAX &&
+                                        c9 < COEFF_MAX && c10 < COEFF_MAX && c11 < COEFF_MAX) {
+                                    skipped_count += (COEFF_MAX - COEFF_MIN + 1) * (COEFF_MAX - COEFF_MIN + 1);
+                                } else {
+#endif
+                                    STA(12);
+#if 0
+                                        STA(11);
+                                            const binsquare_t binsquare = _cvtmask32_u32(_mm256_cmpneq_epi8_mask(square, _mm256_setzero_si256()));
+                                            const size_t off = binsquare >> 6;
+                                            const uint64_t mask = ((uint64_t) 1) << (binsquare & ((binsquare_t) (64-1)));
+                                            if (unlikely(!(map[off] & mask))) {
+                                                map[off] |= mask;
+                                                innovative_count++;
+                                                //printf("inn: "); print_square(square);
+                                                //print_binsquare(binsquare);
+                                            }
+                                        END(11);
+#else
+                                        if (unlikely(ext_out == 0)) {
+                                            /* Only the values of c13 outside the old range. */
+                                            PUSH(13);
+                                            ADD(13, COEFF_MIN);
+                                            for (c13 = COEFF_MIN; c13 < ext_min; c13 ++) {
+                                                const binsquare_t binsquare = square_nonzero(square);
+                                                INSERT(binsquare);
+                                                ADD(13, 1);
+                                            }
+                                            ADD(13, ext_max + 1 - ext_min);
+                                            for (c13 = ext_max + 1; c13 <= COEFF_MAX; c13 ++) {
+                                                const binsquare_t binsquare = square_nonzero(square);
+                                                INSERT(binsquare);
+                                                ADD(13, 1);
+                                            }
+                                            POP(13);
+                                            insert_count += OUTER_RADIX - (ext_max - ext_min + 1);
+                                        } else
+                                        GEN_RADIX_SWITCH(OUTER_RADIX,
+                                        PUSH(13);
+                                        ADD(13, COEFF_MIN);
+                                        binsquare_t mask = square_nonzero(square);
+                                        for (c13 = COEFF_MIN+1; c13 < COEFF_MIN + gen_radix; c13 ++) {
+                                            ADD(13, 1);
+                                            const binsquare_t binsquare = mask;
+                                            mask = square_nonzero(square);
+                                            INSERT(binsquare);
+                                        }
+                                        const binsquare_t binsquare = mask;
+                                        INSERT(binsquare);
+                                        POP(13);
+                                        insert_count += gen_radix;
+                                        )
+#endif
+                                    END(12);
+#if defined(LINEAR_DEP)
+                                }
+#endif
+#if defined(DIHEDRAL)
+                                }
+#endif
+                                END(11);
+                            END(10);
+                        END(9);
+                    END(8);
+                END(7);
+            END(6);
+#endif
+            PROBE_FLUSH();
+            if (ckpt_done != NULL)
+                __atomic_store_n(&ckpt_done[outer], 1, __ATOMIC_RELEASE);
+            PROGRESS_UPDATE();
+        }
+
+        if (mode == INSERT_SHARDED) {
+            shard_finish(&shard);
+            innovative_count += shard.innovative_count;
         }
 
         printf("Final square:    ");
         print_square(square);
+        free(filter);
+    }
+
+    free(shard_rings);
+
+    return innovative_count;
+}
+
+/* Report how many map reads the filter saved in the last enumerate() call. */
+static void filter_report(void)
+{
+    if (filter_bits == 0)
+        return;
+    printf("filter: %" PRIu64 " of %" PRIu64 " inserts (%.2f%%) hit, "
+            "%.1f MiB of map cache lines not read\n", filter_hits, insert_count,
+            100.0 * filter_hits / insert_count, filter_hits * 64.0 / (1 << 20));
+}
+
+/*
+ * Run the same coefficient range with every insert path on separate maps,
+ * report the wall time of each and check that the resulting maps match.
+ */
+static void bench_insert(void)
+{
+    static const struct {
+        enum insert_mode mode;
+        const char *name;
+    } modes[] = {
+        {INSERT_CRITICAL, "critical"},
+        {INSERT_ATOMIC,   "atomic"},
+        {INSERT_SHARDED,  "sharded"},
+    };
+    const int nmodes = sizeof(modes) / sizeof(modes[0]);
+    uint64_t counts[nmodes], checksums[nmodes];
+    double times[nmodes];
+    int i;
+
+    /* Only one map at a time: they are compared by their checksums. */
+    for (i = 0; i < nmodes; i ++) {
+        uint64_t *const map = binsquare_init();
+        times[i] = omp_get_wtime();
+        const uint64_t count = enumerate(map, modes[i].mode);
+        times[i] = omp_get_wtime() - times[i];
+        printf("%-8s: %.3f s, innovative_count = %" PRIu64 "\n",
+                modes[i].name, times[i], count);
+        checksums[i] = bench_checksum(map, BINSQUARE_MAP_SIZE / sizeof(uint64_t),
+                &counts[i]);
+        bsmap_free(map, BINSQUARE_MAP_SIZE, bsmap_pages_got);
+    }
+
+    for (i = 1; i < nmodes; i ++) {
+        printf("%-8s: speedup = %.2fx over %s with %d thread(s)\n",
+                modes[i].name, times[0] / times[i], modes[0].name,
+                omp_get_max_threads());
+        if (counts[i] != counts[0] || checksums[i] != checksums[0]) {
+            fprintf(stderr, "error: bsmaps differ between %s and %s\n",
+                    modes[0].name, modes[i].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * For every pair of nodes, measure the latency of dependent random loads and
+ * the rate of independent ones from the threads pinned to the first node
+ * into a buffer bound to the second.
+ */
+#define BENCH_NUMA_SIZE   (((size_t) 1) << 30) /* Per node */
+#define BENCH_NUMA_NLOADS (((size_t) 1) << 22) /* Per thread and node pair */
+
+static void bench_numa(void)
+{
+    const int m = bsmap_numa.nnodes;
+    const size_t mask = BENCH_NUMA_SIZE / sizeof(uint64_t) - 1;
+    uint64_t *bufs[BSMAP_NUMA_MAX_NODES], sink = 0;
+    double lat[BSMAP_NUMA_MAX_NODES][BSMAP_NUMA_MAX_NODES] = {{0}};
+    double rate[BSMAP_NUMA_MAX_NODES][BSMAP_NUMA_MAX_NODES] = {{0}};
+    int nthreads[BSMAP_NUMA_MAX_NODES] = {0};
+    int j, k;
+
+    for (k = 0; k < m; k ++) {
+        enum bsmap_pages got;
+        bufs[k] = bsmap_alloc(BENCH_NUMA_SIZE, bsmap_pages, &got);
+        if (bufs[k] == NULL) {
+            fprintf(stderr, "bsmap_alloc: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (m > 1 && bsmap_numa_mbind(bufs[k], BENCH_NUMA_SIZE, BSMAP_MPOL_BIND,
+                    ((uint64_t) 1) << k)) {
+            fprintf(stderr, "mbind: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        (void) memset(bufs[k], 0, BENCH_NUMA_SIZE);
     }
 
+#pragma omp parallel reduction(+:sink)
+    {
+        const int tid = omp_get_thread_num(), n = omp_get_num_threads();
+        const int home = bsmap_numa_node_of(tid, n);
+        int to;
+
+        bsmap_numa_pin(tid, n);
+#pragma omp atomic
+        nthreads[home] ++;
+        for (to = 0; to < m; to ++) {
+            const uint64_t *buf = bufs[to];
+            uint64_t x = tid;
+            size_t i;
+            double t;
+
+#pragma omp barrier
+            t = omp_get_wtime();
+            for (i = 0; i < BENCH_NUMA_NLOADS; i ++)
+                x = bench_mix(x + buf[x & mask]);
+            t = omp_get_wtime() - t;
+#pragma omp atomic
+            lat[home][to] += t / BENCH_NUMA_NLOADS;
+            sink += x;
+
+#pragma omp barrier
+            t = omp_get_wtime();
+            for (i = 0; i < BENCH_NUMA_NLOADS; i ++)
+                x += buf[bench_mix(i + tid * BENCH_NUMA_NLOADS) & mask];
+            t = omp_get_wtime() - t;
+#pragma omp atomic
+            rate[home][to] += BENCH_NUMA_NLOADS / t;
+            sink += x;
+        }
+    }
+
+    for (j = 0; j < m; j ++) {
+        if (nthreads[j] == 0)
+            continue;
+        for (k = 0; k < m; k ++)
+            printf("numa: node %d -> node %d: %.1f ns/load dependent, "
+                    "%.3e loads/s (%.2f GB/s of lines) independent, %d thread(s)\n",
+                    bsmap_numa.node[j], bsmap_numa.node[k],
+                    lat[j][k] / nthreads[j] * 1e9, rate[j][k],
+                    rate[j][k] * 64 / 1e9, nthreads[j]);
+    }
+    if (sink == 42)
+        printf("\n");
+}
+
+/*
+ * Time one enumeration with the given insert path and check the bsmap
+ * against the golden checksums instead of writing it.  Return non-zero on a
+ * mismatch.
+ */
+static int bench(const enum insert_mode mode, const int check)
+{
+    uint64_t *map = binsquare_init();
+    uint64_t count, checksum;
+    double time;
+
+    if (ext_fp != NULL)
+        extend_read(map);
+    bench_tlb_start();
+    time = omp_get_wtime();
+    (void) enumerate(map, mode);
+    time = omp_get_wtime() - time;
+    bench_report(bench_tuples(outer_end - outer_begin, OUTER_RADIX, ORDER*2+2 - 6,
+                COEFF_MAX + 1),
+            insert_count, time, omp_get_max_threads());
+    bench_tlb_report(insert_count);
+    filter_report();
+#if defined(DIHEDRAL)
+    /* The references are for full maps. */
+    dihedral_finalize(map, 1);
+#endif
+    checksum = bench_checksum(map, BINSQUARE_MAP_SIZE / sizeof(uint64_t), &count);
+    if (!check) {
+        printf("golden: Not checked for a shard\n");
+        return 0;
+    }
+    return bench_check(ORDER, COEFF_MIN, COEFF_MAX, count, checksum);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--bench | --bench-insert | --bench-numa] [--critical | --sharded]\n"
+            "          [--checkpoint SEC] [--resume] [--shard I/N]\n"
+            "          [--progress SEC] [--stats FILE] [--hugepages 1g|2m|thp|none]\n"
+            "          [--numa none|interleave|partition] [--pin] [--probe-batch N]\n"
+            "          [--filter N] [--extend-from BSMAP]\n", argv0);
+    fprintf(stderr, "  --bench           Time the enumeration and check the bsmap instead of writing it\n");
+    fprintf(stderr, "  --bench-insert    Compare all insert paths and exit\n");
+    fprintf(stderr, "  --bench-numa      Measure load latency and rate between all nodes and exit\n");
+    fprintf(stderr, "  --critical        Insert with the global critical section\n");
+    fprintf(stderr, "  --sharded         Route inserts to per-thread shard owners (not with --checkpoint)\n");
+    fprintf(stderr, "  --checkpoint SEC  Checkpoint every SEC seconds (0: only on SIGUSR1)\n");
+    fprintf(stderr, "  --resume          Resume from the last checkpoint\n");
+    fprintf(stderr, "  --shard I/N       Only cover the I-th of N slices of the outer loops\n");
+    fprintf(stderr, "  --progress SEC    Report progress and ETA every SEC seconds\n");
+    fprintf(stderr, "  --stats FILE      Also append the progress reports to FILE as TSV\n");
+    fprintf(stderr, "  --hugepages SIZE  Page size of the bsmap (default: thp)\n");
+    fprintf(stderr, "  --numa MODE       Placement of the bsmap over the nodes (default: none)\n");
+    fprintf(stderr, "  --pin             Pin the threads to the nodes in blocks; with --numa partition\n"
+            "                    and --sharded every insert is done on the node it belongs to\n");
+    fprintf(stderr, "  --probe-batch N   Prefetch and probe the bsmap in batches of N (0: off, default 64, max %d)\n",
+            PROBE_BATCH_MAX);
+    fprintf(stderr, "  --filter N        Check a per-thread filter of N (a power of 2, max 2^%d) recently\n"
+            "                    seen binsquares before the bsmap (0: off)\n", FILTER_BITS_MAX);
+    fprintf(stderr, "  --extend-from BSMAP  Start from the bsmapz BSMAP of a narrower range and only\n"
+            "                    enumerate the tuples outside of it\n");
+}
+
+#if defined(GEN_KERNEL)
+int GEN_KERNEL(int argc, char *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+    static const struct option longopts[] = {
+        {"bench",        no_argument, NULL, 'B'},
+        {"bench-insert", no_argument, NULL, 'b'},
+        {"critical",     no_argument, NULL, 'c'},
+        {"sharded",      no_argument, NULL, 's'},
+        {"checkpoint",   required_argument, NULL, 'k'},
+        {"resume",       no_argument, NULL, 'r'},
+        {"shard",        required_argument, NULL, 'S'},
+        {"progress",     required_argument, NULL, 'p'},
+        {"stats",        required_argument, NULL, 'T'},
+        {"hugepages",    required_argument, NULL, 'H'},
+        {"numa",         required_argument, NULL, 'N'},
+        {"pin",          no_argument, NULL, 'P'},
+        {"bench-numa",   no_argument, NULL, 'n'},
+        {"probe-batch",  required_argument, NULL, 'q'},
+        {"filter",       required_argument, NULL, 'f'},
+        {"extend-from",  required_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0},
+    };
+    enum insert_mode mode = INSERT_ATOMIC;
+    int do_bench = 0, do_bench_insert = 0, do_bench_numa = 0;
+    int do_checkpoint = 0, do_resume = 0;
+    unsigned checkpoint_interval = 0;
+    unsigned shard = 0, nshards = 0;
+    unsigned progress_interval = 0;
+    const char *stats_path = NULL, *extend_path = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'B':
+                do_bench = 1;
+                break;
+            case 'b':
+                do_bench_insert = 1;
+                break;
+            case 'c':
+                mode = INSERT_CRITICAL;
+                break;
+            case 's':
+                mode = INSERT_SHARDED;
+                break;
+            case 'k':
+                do_checkpoint = 1;
+                checkpoint_interval = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                do_checkpoint = 1;
+                do_resume = 1;
+                break;
+            case 'f': {
+                const unsigned long len = strtoul(optarg, NULL, 0);
+                for (filter_bits = 0; (1UL << filter_bits) < len; filter_bits ++)
+                    ;
+                if (len == 1 || (len & (len - 1)) || filter_bits > FILTER_BITS_MAX) {
+                    fprintf(stderr, "error: Invalid filter length: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'e':
+                extend_path = optarg;
+                break;
+            case 'S':
+                if (sscanf(optarg, "%u/%u", &shard, &nshards) != 2
+                        || nshards == 0 || shard >= nshards) {
+                    fprintf(stderr, "error: Invalid shard: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                progress_interval = strtoul(optarg, NULL, 0);
+                if (progress_interval == 0) {
+                    fprintf(stderr, "error: Invalid progress interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                stats_path = optarg;
+                break;
+            case 'N':
+                if (bsmap_numa_parse(optarg, &numa_mode)) {
+                    fprintf(stderr, "error: Invalid NUMA mode: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                numa_pin = 1;
+                break;
+            case 'n':
+                do_bench_numa = 1;
+                break;
+            case 'q':
+                probe_batch = strtoul(optarg, NULL, 0);
+                if (probe_batch > PROBE_BATCH_MAX) {
+                    fprintf(stderr, "error: Invalid probe batch: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                if (bsmap_pages_parse(optarg, &bsmap_pages)) {
+                    fprintf(stderr, "error: Invalid page size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Built on %s %s\n", __DATE__, __TIME__);
+    printf("ORDER = %d\n", ORDER);
+    printf("COEFF_{MIN,MAX} = {%d, %d}\n", COEFF_MIN, COEFF_MAX);
+#if defined(GRAY) && defined(GEN_KERNEL)
+    if (GRAY_RADIX < 2) {
+        fprintf(stderr, "error: GRAY requires COEFF_MIN < COEFF_MAX\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+    /*
+     * A sharded insert can still sit in a producer's batch or an owner's ring
+     * when its outer iteration is marked done, so a checkpoint could list
+     * iterations whose patterns are not in the map.
+     */
+    if (mode == INSERT_SHARDED && do_checkpoint) {
+        fprintf(stderr, "error: --sharded cannot be combined with --checkpoint or --resume\n");
+        exit(EXIT_FAILURE);
+    }
+    outer_begin = 0;
+    outer_end = OUTER_LEN;
+
+    bsmap_numa_init();
+    printf("NUMA: %d node(s), bsmap placement %s%s\n", bsmap_numa.nnodes,
+            bsmap_numa_names[numa_mode], numa_pin ? ", threads pinned" : "");
+    if (do_bench_numa) {
+        bench_numa();
+        return 0;
+    }
+
+#if defined(DIHEDRAL)
+    dihedral_init();
+#endif
+
+    if (extend_path != NULL) {
+#if defined(GRAY)
+        fprintf(stderr, "error: --extend-from is not supported with GRAY\n");
+        exit(EXIT_FAILURE);
+#endif
+        if (do_bench_insert) {
+            fprintf(stderr, "error: --extend-from is not supported with --bench-insert\n");
+            exit(EXIT_FAILURE);
+        }
+        extend_open(extend_path);
+    }
+
+    if (do_bench_insert) {
+        bench_insert();
+        return 0;
+    }
+
+    bsmap_path_init(shard, nshards);
+    if (nshards != 0) {
+        outer_begin = OUTER_LEN * shard / nshards;
+        outer_end = OUTER_LEN * (shard + 1) / nshards;
+        printf("Shard %u/%u: outer iterations [%zu, %zu) of %zu\n",
+                shard, nshards, outer_begin, outer_end, (size_t) OUTER_LEN);
+    }
+
+    if (do_bench)
+        return bench(mode, nshards == 0) ? EXIT_FAILURE : 0;
+
+    uint64_t *map = binsquare_init();
+
+    if (do_checkpoint)
+        ckpt_start(map, checkpoint_interval, do_resume);
+    if (stats_path != NULL && progress_interval == 0)
+        progress_interval = 60;
+    if (ext_fp != NULL) {
+        extend_read(map);
+        /* The loaded patterns are not in the checkpoint yet. */
+        if (do_checkpoint)
+            ckpt_mark_loaded(map);
+    }
+    if (progress_interval != 0)
+        progress_start(progress_interval, stats_path);
+
+    const uint64_t innovative_count = enumerate(map, mode);
+    printf("innovative_count = %" PRIu64 "\n", innovative_count);
+    filter_report();
+
+    if (progress_interval != 0)
+        progress_stop();
+
+    if (do_checkpoint)
+        ckpt_stop();
+#if defined(LINEAR_DEP)
+    printf("skipped_count = %" PRIu64 "\n", skipped_count);
+#endif
+
+#if defined(DIHEDRAL_EXPAND)
+    printf("Expanding dihedral orbits\n");
+    dihedral_finalize(map, 1);
+#elif defined(DIHEDRAL)
+    printf("Canonicalizing dihedral orbits\n");
+    dihedral_finalize(map, 0);
+#endif
+
+    printf("Writing bsmap to %s\n", bsmap_path);
     fflush(stdout);
-    printf("Writing bsmap to file\n");
     binsquare_finalize(map);
 
+    if (nshards != 0) {
+        printf("Gather all shards with ./bsmap_gather bsmap.%d.%d.%d" BSMAP_SUFFIX
+                ".shard*of%u\n", ORDER, COEFF_MIN, COEFF_MAX, nshards);
+        return 0;
+    }
+
     {
-        char str[0x100];
-        snprintf(str, sizeof(str), "./bsmap_gather bsmap.%d.%d.%d",
-                ORDER, COEFF_MIN, COEFF_MAX);
+        char str[0x200];
+        snprintf(str, sizeof(str), "./bsmap_gather %s", bsmap_path);
         (void) execl("/bin/sh", "sh", "-c", str, NULL);
     }
 
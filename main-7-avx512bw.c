@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2019 Sugizaki Yukimasa (sugizaki@hpcs.cs.tsukuba.ac.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+/*
+ * ORDER=7 generator.  A dense bsmap would take 1 << 49 bits, so the
+ * binsquares go to the out-of-core store of bsstore.h instead, which writes
+ * the distinct ones as a sorted bslist ("bslist.7.MIN.MAX") within a memory
+ * budget given with --mem.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <immintrin.h>
+#include <omp.h>
+
+
+#if defined(ORDER) && ORDER != 7
+#error "This program is for ORDER=7 only"
+#endif
+#define ORDER 7
+
+#if !defined(COEFF_MIN) || !defined(COEFF_MAX)
+#error "Define COEFF_MIN and COEFF_MAX"
+#endif
+
+#if COEFF_MIN > COEFF_MAX
+#error "COEFF_MIN must be smaller or equal to COEFF_MAX"
+#endif
+
+/* The cells are int8_t: every sum of 2*ORDER+2 coefficients must fit. */
+#if COEFF_MIN * (2*ORDER + 2) < -127 || COEFF_MAX * (2*ORDER + 2) > 127
+#error "Coefficients out of range for ORDER=7"
+#endif
+
+#if !defined(__AVX512BW__)
+#error "Build with -mavx512bw"
+#endif
+
+typedef __m512i square_t;
+typedef uint64_t binsquare_t;
+
+#define square_nonzero(square) \
+    ((binsquare_t) _cvtmask64_u64(_mm512_cmpneq_epi8_mask(square, _mm512_setzero_si512())))
+
+/*
+ * Cell (i, j) is byte and bit i*ORDER + j.  Lines 0 to ORDER-1 are the rows,
+ * ORDER to 2*ORDER-1 the columns, then the diagonal and the anti-diagonal.
+ */
+#define LINE_MASK(line_id) \
+    ((line_id) < ORDER ? UINT64_C(0x7f) << ((line_id) * ORDER) \
+     : (line_id) < ORDER*2 ? UINT64_C(0x40810204081) << ((line_id) - ORDER) \
+     : (line_id) == ORDER*2 ? UINT64_C(0x1010101010101) \
+     : UINT64_C(0x41041041040))
+
+#define get_add(line_id, c) _mm512_maskz_set1_epi8(LINE_MASK(line_id), (c))
+
+#define square_addsub_line(square, line_id, c) \
+    square = _mm512_add_epi8(square, get_add(line_id, c))
+
+#include "bsstore.h"
+
+/*
+ * The outer (c0, ..., c3) iterations are numbered in loop order, c3 running
+ * fastest, and c0 only runs over non-negative values: t and -t give the
+ * same pattern.
+ */
+#define OUTER_RADIX (COEFF_MAX - COEFF_MIN + 1)
+#define OUTER_LEN ((size_t) (COEFF_MAX + 1) * OUTER_RADIX * OUTER_RADIX * OUTER_RADIX)
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--mem SIZE] [--tmpdir DIR]\n", argv0);
+    fprintf(stderr, "  --mem SIZE    Memory budget of the store, with an optional k, m or g suffix\n"
+            "                (default: 1g)\n");
+    fprintf(stderr, "  --tmpdir DIR  Directory to spill the sorted runs to (default: .)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option longopts[] = {
+        {"mem",    required_argument, NULL, 'm'},
+        {"tmpdir", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0},
+    };
+    size_t budget = ((size_t) 1) << 30;
+    const char *tmpdir = ".";
+    struct bsstore store;
+    char bslist_path[0x100];
+    uint64_t insert_count = 0, count;
+    double time;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                budget = bsstore_parse_size(optarg);
+                if (budget == 0) {
+                    fprintf(stderr, "error: Invalid memory budget: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                tmpdir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Built on %s %s\n", __DATE__, __TIME__);
+    printf("ORDER = %d\n", ORDER);
+    printf("COEFF_{MIN,MAX} = {%d, %d}\n", COEFF_MIN, COEFF_MAX);
+
+    snprintf(bslist_path, sizeof(bslist_path), "bslist.%d.%d.%d", ORDER,
+            COEFF_MIN, COEFF_MAX);
+    bsstore_init(&store, budget, omp_get_max_threads(), tmpdir, bslist_path,
+            ORDER*ORDER);
+
+#define PUSH(n) square_orig_c##n = square
+
+#define LOOP(n) for (c##n = COEFF_MIN; c##n <= COEFF_MAX; c##n ++)
+
+#define ADD(n, c) square_addsub_line(square, n, c)
+
+#define POP(n) square = square_orig_c##n
+
+#define STA(n) PUSH(n); ADD(n, COEFF_MIN); LOOP(n) {
+#define END(n) ADD(n, 1); } POP(n)
+
+    time = omp_get_wtime();
+#pragma omp parallel reduction(+:insert_count)
+    {
+        const int tid = omp_get_thread_num();
+        square_t square;
+        size_t outer;
+        int c0, c1, c2, c3;
+
+#define X(n) int c##n; square_t square_orig_c##n;
+            X(4)
+            X(5)
+            X(6)
+            X(7)
+            X(8)
+            X(9)
+            X(10)
+            X(11)
+            X(12)
+            X(13)
+            X(14)
+            X(15)
+#undef X
+
+#pragma omp for schedule(dynamic) nowait
+        for (outer = 0; outer < OUTER_LEN; outer ++) {
+            size_t rest = outer;
+            c3 = COEFF_MIN + rest % OUTER_RADIX;
+            rest /= OUTER_RADIX;
+            c2 = COEFF_MIN + rest % OUTER_RADIX;
+            rest /= OUTER_RADIX;
+            c1 = COEFF_MIN + rest % OUTER_RADIX;
+            c0 = rest / OUTER_RADIX;
+
+            square = _mm512_setzero_si512();
+            ADD(0, c0);
+            ADD(1, c1);
+            ADD(2, c2);
+            ADD(3, c3);
+            STA(4);
+             STA(5);
+              STA(6);
+               STA(7);
+                STA(8);
+                 STA(9);
+                  STA(10);
+                   STA(11);
+                    STA(12);
+                     STA(13);
+                      STA(14);
+                       STA(15);
+                        bsstore_insert(&store, tid, square_nonzero(square));
+                       END(15);
+                       insert_count += OUTER_RADIX;
+                      END(14);
+                     END(13);
+                    END(12);
+                   END(11);
+                  END(10);
+                 END(9);
+                END(8);
+               END(7);
+              END(6);
+             END(5);
+            END(4);
+        }
+    }
+    time = omp_get_wtime() - time;
+    printf("Enumerated %" PRIu64 " tuples in %.3f s\n", insert_count, time);
+
+    printf("Writing bslist to %s\n", bslist_path);
+    fflush(stdout);
+    time = omp_get_wtime();
+    count = bsstore_finish(&store, bslist_path);
+    printf("Merged in %.3f s\n", omp_get_wtime() - time);
+    printf("innovative_count = %" PRIu64 "\n", count);
+
+    return 0;
+}